@@ -0,0 +1,190 @@
+// The admin module serves the server's metrics over HTTP.
+
+// A single thread listens on a loopback-only port and answers every
+// "GET /metrics" (or "GET /") with metrics_render's output, in the
+// Prometheus text format, so a Prometheus server, curl or a browser can
+// watch the arena live. It is deliberately minimal: HTTP/1.0, one
+// request per connection, one connection at a time. None of this is on
+// the reactors' path -- a slow scrape only delays the next scrape.
+
+// This gives access to accept4
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rcu.h"
+#include "metrics.h"
+#include "admin.h"
+
+static const char not_found[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 10\r\n"
+    "\r\n"
+    "Not found\n";
+
+/************************************************************************
+ * Write all of "len" bytes at "data" to "fd" (a blocking socket),
+ * giving up on any error.
+ */
+static void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/************************************************************************
+ * Read the request header on "fd" into "buf" (NUL-terminated). Returns
+ * false if the client went away or took too long.
+ */
+static int read_request(int fd, char* buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = recv(fd, buf + len, size - 1 - len, 0);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            return 0;
+        len += n;
+        buf[len] = '\0';
+        if ((strstr(buf, "\r\n\r\n") != NULL) || (strstr(buf, "\n\n") != NULL))
+            return 1;
+    }
+    return 1;  // Too long to be a header we care about; answer anyway
+}
+
+/************************************************************************
+ * Answer one request on connection "fd". The metrics are rendered
+ * online (they read room rosters); everything that might block is done
+ * offline, so a stuck client never holds up an RCU grace period.
+ */
+static void serve(int fd) {
+    char req[ADMIN_MAXREQUEST];
+    if (!read_request(fd, req, sizeof(req)))
+        return;
+
+    if ((strncmp(req, "GET /metrics ", 13) != 0) &&
+        (strncmp(req, "GET / ", 6) != 0)) {
+        write_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    rcu_thread_online();
+    size_t len;
+    char* body = metrics_render(&len);
+    rcu_thread_offline();
+
+    char header[128];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n"
+                        "\r\n", len);
+    write_all(fd, header, hlen);
+    write_all(fd, body, len);
+    free(body);
+}
+
+/************************************************************************
+ * Handle a failed accept. Most failures (such as running out of file
+ * descriptors) last a while, so wait a little before trying again
+ * rather than spinning, and only report them now and then.
+ */
+static void accept_failed(void) {
+    static time_t last_complaint;
+    if ((errno == EINTR) || (errno == ECONNABORTED))
+        return;
+
+    time_t now = time(NULL);
+    if (now - last_complaint >= ADMIN_COMPLAIN_SECS) {
+        perror("admin - accept");
+        last_complaint = now;
+    }
+    struct timespec ts = { 0, ADMIN_RETRY_MS * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/************************************************************************
+ * The admin thread: accept connections one at a time, forever.
+ */
+static void* admin_thread(void* arg) {
+    int listen_fd = *(int*)arg;
+    free(arg);
+
+    rcu_register_thread();
+    rcu_thread_offline();
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            accept_failed();
+            continue;
+        }
+
+        struct timeval tv = { ADMIN_TIMEOUT_SECS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * admin_start starts the admin thread, listening on 127.0.0.1:"port".
+ * Returns false if the port couldn't be opened.
+ */
+int admin_start(int port) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("admin - socket");
+        return 0;
+    }
+
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+        (listen(fd, 16) < 0)) {
+        perror("admin - bind");
+        close(fd);
+        return 0;
+    }
+
+    int* arg = malloc(sizeof(int));
+    if (arg == NULL) {
+        perror("admin_start");
+        exit(1);
+    }
+    *arg = fd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, arg) != 0) {
+        fprintf(stderr, "Couldn't start admin thread.\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+    return 1;
+}
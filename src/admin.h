@@ -0,0 +1,23 @@
+// Prototypes for the admin module: the metrics endpoint
+
+#ifndef _ADMIN_H
+#define _ADMIN_H
+
+// Default port for the admin listener, which only listens on loopback
+
+#define ADMIN_PORT 9090
+
+// Longest request the admin listener reads, and how long it waits for it
+
+#define ADMIN_MAXREQUEST 2048
+#define ADMIN_TIMEOUT_SECS 2
+
+// After a failed accept (out of file descriptors, say), how long the
+// admin listener waits before trying again, and how often it says so
+
+#define ADMIN_RETRY_MS 100
+#define ADMIN_COMPLAIN_SECS 10
+
+int admin_start(int port);
+
+#endif  // _ADMIN_H
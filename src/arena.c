@@ -1,63 +1,46 @@
 // This is the main program for the arena server
 
-// The job of this module is to set the system up and then turn each
-// command received from the client over to the arena_protocol module
-// which will handle the actual communication protocol between clients
-// (players) and the server.
+// The job of this module is to set the system up: create the listening
+// sockets and start the reactor threads, which read commands from the
+// clients and turn them over to the arena_protocol module to handle the
+// actual communication protocol between clients (players) and the
+// server.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "admin.h"
+#include "arena_protocol.h"
+#include "executor.h"
+#include "history.h"
+#include "outq.h"
 #include "player.h"
 #include "pllist.h"
-#include "arena_protocol.h"
-
-/***********************************************************************
- * The client thread handles the basic network read loop -- get a line
- * from the network connection and process it.
- */
-static void* client_thread(void* arg) {
-    player_info* player = (player_info*)arg;
-    pllist_add(player);
-
-    // Detatch - unpredictable thread start/stop patterns
-
-    pthread_detach(player->thread);
-
-    char* lineptr = NULL;
-    size_t linesize = 0;
-
-    while (player->state != PLAYER_DONE) {
-        if (getline(&lineptr, &linesize, player->fp_recv) < 0) {
-            // Failed getline means the client disconnected
-            break;
-        }
-        docommand(player, lineptr);
-    }
+#include "reactor.h"
+#include "room.h"
+#include "trace.h"
 
-    // Finished with session, so unregister it and free resources.
+// The port the server listens on, and the most reactor threads allowed
 
-    if (lineptr != NULL) {
-        free(lineptr);
-    }
-
-    printf("Client %ld disconnected.\n", player->thread);
-    pllist_remove(player);
-
-    return NULL;
-}
+#define ARENA_PORT "8080"
+#define ARENA_MAXREACTORS 64
 
 /********************************************************************
  * Make a TCP listener for port "service" (given as a sting, but
  * either a port number or service name). This function will only
- * create a public listener (listening on all interfaces).
+ * create a public listener (listening on all interfaces). The socket is
+ * non-blocking, for use in a reactor's epoll set. Several listeners can
+ * be bound to the same port (SO_REUSEPORT), one per reactor thread.
  *
  * Either returns a file handle to use with accept(), or -1 on error.
  * In general, error reporting could be improved, but this just indicates
@@ -65,7 +48,7 @@ static void* client_thread(void* arg) {
  */
 static int create_listener(char* service) {
     int sock_fd;
-    if ((sock_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sock_fd=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket");
         return -1;
     }
@@ -107,7 +90,7 @@ static int create_listener(char* service) {
     }
 
     // Finally, set up listener connection queue
-    int lret = listen(sock_fd, 128);
+    int lret = listen(sock_fd, SOMAXCONN);
     if (lret < 0) {
         perror("listen");
         close(sock_fd);
@@ -117,35 +100,227 @@ static int create_listener(char* service) {
     return sock_fd;
 }
 
+// One listener per reactor
+
+static int listen_fds[ARENA_MAXREACTORS];
+
 /************************************************************************
- * Part 2 main: networked server. Spawns a new thread for each connection.
- * Probably should put an upper limit on this, but we're not going to
- * go crazy with a million clients in this class assignment...
+ * Thread start function for all but the first reactor (which runs on
+ * the main thread). The argument is the reactor number.
+ */
+static void* reactor_thread(void* arg) {
+    int id = (long)arg;
+    reactor_run(id, listen_fds[id]);
+    return NULL;
+}
+
+/************************************************************************
+ * Raise the open file limit as far as we are allowed -- each player
+ * needs a file descriptor, and the default soft limit is usually 1024.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/************************************************************************
+ * Print the server counters.
+ */
+static void print_stats(void) {
+    outq_stats os;
+    outq_get_stats(&os);
+    printf("outq: %lu enqueued, %lu dropped, %lu slow consumers "
+           "disconnected, %lu bytes sent in %lu writes\n",
+           os.enqueued, os.dropped, os.disconnected, os.bytes_sent,
+           os.writes);
+    printf("rooms: %d\n", room_count());
+    slab_stats ps;
+    player_get_pool_stats(&ps);
+    printf("players: %lu in use of %lu pooled in %lu slabs, %lu "
+           "allocated, %lu freed by another thread\n", ps.in_use,
+           ps.capacity, ps.slabs, ps.allocs, ps.remote_frees);
+}
+
+/************************************************************************
+ * Write the trace rings to a new file in the current directory.
+ */
+static void dump_trace(void) {
+    static int ndumps;
+    if (!TRACE_ENABLED) {
+        printf("trace: not built in (rebuild with make TRACE=1)\n");
+        return;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "arena-trace-%d-%d.json", (int)getpid(),
+             ++ndumps);
+    int count = trace_dump(path);
+    if (count < 0)
+        perror(path);
+    else
+        printf("trace: %d events written to %s\n", count, path);
+}
+
+/************************************************************************
+ * The stats thread waits for SIGUSR1 or SIGUSR2 (blocked in every other
+ * thread). SIGUSR1 prints the server counters, and SIGUSR2 dumps the
+ * trace.
+ */
+static void* stats_thread(void* arg) {
+    sigset_t* sigs = (sigset_t*)arg;
+    int sig;
+    while (sigwait(sigs, &sig) == 0) {
+        if (sig == SIGUSR1)
+            print_stats();
+        else
+            dump_trace();
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * Print the command line options and exit.
+ */
+static void usage(char* progname) {
+    fprintf(stderr, "Usage: %s [-t reactor threads (1-%d)] "
+            "[-q max queued messages per player] [-p drop|disconnect] "
+            "[-a admin port, 0 for none] [-T tick ms (0-%d), 0 for none] "
+            "[-u (use io_uring)] [-P (pin reactors to cores)] "
+            "[-w command workers (0-%d), 0 for none] "
+            "[-H chat history directory]\n",
+            progname, ARENA_MAXREACTORS, REACTOR_MAXTICK,
+            EXECUTOR_MAXWORKERS);
+    exit(1);
+}
+
+/************************************************************************
+ * Networked server main. All connections are handled by a small, fixed
+ * number of reactor threads (-t option, default 1), so the number of
+ * threads no longer grows with the number of players. Each room is
+ * served by one of them (pinned to a core of its own with -P). Send SIGUSR1 to
+ * print the server counters, or fetch http://127.0.0.1:9090/metrics (-a
+ * option) for the full set of metrics. With -T, announcements and
+ * messages to other players go out once per tick, and with -u the
+ * reactors use io_uring instead of epoll. With -w, commands are run by a
+ * pool of worker threads, and the reactors only do the I/O. With -H,
+ * what is said in each room is kept in files in the given directory, so
+ * it outlasts a restart. In a "make TRACE=1" build, SIGUSR2 dumps the
+ * latest trace events as a Chrome trace.
  */
 int main(int argc, char* argv[]) {
-    pllist_init();
+    int nreactors = 1;
+    int maxmsgs = OUTQ_DEF_MAXMSGS;
+    int policy = OUTQ_DROP_OLDEST;
+    int admin_port = ADMIN_PORT;
+    int tick_ms = 0;
+    int backend = REACTOR_EPOLL;
+    int pin = 0;
+    int nworkers = 0;
+    char* history_dir = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:q:p:a:T:uPw:H:")) != -1) {
+        switch (opt) {
+        case 't':
+            nreactors = atoi(optarg);
+            if ((nreactors < 1) || (nreactors > ARENA_MAXREACTORS))
+                usage(argv[0]);
+            break;
+        case 'q':
+            maxmsgs = atoi(optarg);
+            if (maxmsgs < 1)
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                policy = OUTQ_DROP_OLDEST;
+            else if (strcmp(optarg, "disconnect") == 0)
+                policy = OUTQ_DISCONNECT;
+            else
+                usage(argv[0]);
+            break;
+        case 'a':
+            admin_port = atoi(optarg);
+            if ((admin_port < 0) || (admin_port > 65535))
+                usage(argv[0]);
+            break;
+        case 'T':
+            tick_ms = atoi(optarg);
+            if ((tick_ms < 0) || (tick_ms > REACTOR_MAXTICK))
+                usage(argv[0]);
+            break;
+        case 'u':
+            backend = REACTOR_URING;
+            break;
+        case 'P':
+            pin = 1;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if ((nworkers < 0) || (nworkers > EXECUTOR_MAXWORKERS))
+                usage(argv[0]);
+            break;
+        case 'H':
+            history_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    int sock_fd = create_listener("8080");
-    if (sock_fd < 0) {
-        fprintf(stderr, "Server setup failed.\n");
+    // A client that disconnects while we write to it must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    // Block SIGUSR1 and SIGUSR2 everywhere (threads inherit this) except
+    // in sigwait
+    trace_init();
+    static sigset_t stats_sigs;
+    sigemptyset(&stats_sigs);
+    sigaddset(&stats_sigs, SIGUSR1);
+    sigaddset(&stats_sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stats_sigs, NULL);
+    pthread_t stats_tid;
+    pthread_create(&stats_tid, NULL, stats_thread, &stats_sigs);
+    pthread_detach(stats_tid);
+
+    outq_configure(maxmsgs, policy);
+    player_pool_init();
+    protocol_init();
+    if (!history_init(history_dir)) {
+        fprintf(stderr, "Can't keep the chat history in %s.\n", history_dir);
         exit(1);
     }
+    if (reactor_configure(nreactors, pin, tick_ms, backend) != backend)
+        fprintf(stderr, "io_uring is not available, using epoll.\n");
+    executor_start(nworkers, tick_ms, reactor_wake);
+
+    pllist_init();
+    if ((admin_port != 0) && !admin_start(admin_port))
+        fprintf(stderr, "No metrics endpoint (admin port %d).\n", admin_port);
+
+    for (int i = 0; i < nreactors; i++) {
+        if ((listen_fds[i] = create_listener(ARENA_PORT)) < 0) {
+            fprintf(stderr, "Server setup failed.\n");
+            exit(1);
+        }
+    }
 
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int comm_fd;
-    while ((comm_fd=accept(sock_fd, (struct sockaddr*)&client_addr,
-                           &client_addr_len)) >= 0) {
-        // Got a new connection, so create a "player" and spawn a thread
-        player_info* new_client = new_player(comm_fd);
-        if (new_client != NULL) {
-            pthread_create(&new_client->thread, NULL, client_thread, new_client);
-            printf("Got connection from %s (client %ld)\n",
-                   inet_ntoa(((struct sockaddr_in*)&client_addr)->sin_addr),
-                   new_client->thread);
+    for (int i = 1; i < nreactors; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reactor_thread, (void*)(long)i) != 0) {
+            fprintf(stderr, "Couldn't start reactor thread.\n");
+            exit(1);
         }
+        pthread_detach(tid);
     }
 
+    reactor_run(0, listen_fds[0]);
+
     printf("Shutting down...\n");
 
     return 0;
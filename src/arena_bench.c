@@ -0,0 +1,571 @@
+// A load generator and benchmark for the arena server.
+
+// This opens a large number of connections to a running server (over
+// loopback, normally), logs each one in, and then has every connection
+// issue commands back to back -- each one waits for the answer to its
+// last command before sending the next -- drawn at random from a
+// configurable mix. It reports the throughput of each command and the
+// 50th, 99th and 99.9th percentile of its latency (from sending the
+// command to reading the whole response), and how fast new connections
+// were set up. A BYE closes the connection, and a new one (with a new
+// login) takes its place, so putting BYE in the mix also measures
+// connection churn.
+//
+// Everything runs on one thread with one epoll set, so the client side
+// stays cheap compared with the server it is measuring.
+//
+// Responses are picked out of the stream by what each command is known
+// to answer with; everything else (room announcements, messages from
+// other players) is skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Defaults for the command line options
+
+#define BENCH_HOST "127.0.0.1"
+#define BENCH_PORT "8080"
+#define BENCH_CONNS 1000
+#define BENCH_SECONDS 10
+#define BENCH_MIX "STAT=30,LIST=15,MSG=30,MOVETO=20,BYE=5"
+
+#define BENCH_MAXEVENTS 256
+#define BENCH_RBUFSIZE 65536
+
+// The commands that can be timed. LOGIN is sent by every new connection
+// and isn't part of the mix.
+
+#define CMD_LOGIN 0
+#define CMD_MOVETO 1
+#define CMD_MSG 2
+#define CMD_LIST 3
+#define CMD_STAT 4
+#define CMD_CREATE 5
+#define CMD_BYE 6
+#define CMD_SAY 7
+#define NCMDS 8
+
+static const char* cmd_names[NCMDS] = {
+    "LOGIN", "MOVETO", "MSG", "LIST", "STAT", "CREATE", "BYE", "SAY"
+};
+
+// Connection states
+
+#define CONN_CONNECTING 0  // Waiting for connect() to finish
+#define CONN_WAITING 1     // Command sent, waiting for the response
+#define CONN_CLOSING 2     // BYE answered, waiting for the server to close
+
+// One client connection
+
+typedef struct {
+    int fd;
+    int state;
+    int cmd;                // Command waiting for a response
+    int list_pending;       // Seen the "OK" of a LIST, want the names
+    int generation;         // How many times this slot has reconnected
+    long long start_ns;     // When the command (or connect) started
+    char name[24];          // Empty until logged in
+    size_t rlen;
+    char rbuf[BENCH_RBUFSIZE];
+} conn;
+
+// All the latencies measured for one command, in nanoseconds
+
+typedef struct {
+    long long* v;
+    size_t n;
+    size_t cap;
+    unsigned long errors;   // ERR responses
+} samples;
+
+static samples results[NCMDS];
+static samples connects;    // From socket() to connected
+static unsigned long connect_failures;
+static unsigned long dropped;  // Connections closed by the server
+
+static int mix[NCMDS];      // Weights, LOGIN always 0
+static int mix_total;
+
+static struct addrinfo* server;
+static int epfd;
+static conn* conns;
+static int nconns;
+
+/************************************************************************
+ * Current time in nanoseconds, from the monotonic clock.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/************************************************************************
+ * Add one measurement to a set of samples.
+ */
+static void record(samples* s, long long ns) {
+    if (s->n == s->cap) {
+        s->cap = (s->cap == 0) ? 4096 : 2 * s->cap;
+        if ((s->v = realloc(s->v, s->cap * sizeof(long long))) == NULL) {
+            perror("record");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = ns;
+}
+
+/************************************************************************
+ * Comparison function for sorting samples.
+ */
+static int cmp_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/************************************************************************
+ * The "p"th quantile (0 to 1) of sorted samples, in microseconds.
+ */
+static double quantile_us(samples* s, double p) {
+    if (s->n == 0)
+        return 0.0;
+    return s->v[(size_t)(p * (s->n - 1))] / 1000.0;
+}
+
+/************************************************************************
+ * Parse a command mix like "STAT=30,MSG=70" into the weights. Returns
+ * false if it doesn't make sense.
+ */
+static int parse_mix(const char* spec) {
+    char* copy = strdup(spec);
+    char* saveptr;
+    memset(mix, 0, sizeof(mix));
+    mix_total = 0;
+
+    for (char* item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char* eq = strchr(item, '=');
+        if (eq == NULL) {
+            free(copy);
+            return 0;
+        }
+        *eq = '\0';
+        int cmd;
+        for (cmd = CMD_LOGIN + 1; cmd < NCMDS; cmd++) {
+            if (strcmp(item, cmd_names[cmd]) == 0)
+                break;
+        }
+        int weight = atoi(eq + 1);
+        if ((cmd == NCMDS) || (weight < 0)) {
+            free(copy);
+            return 0;
+        }
+        mix[cmd] = weight;
+        mix_total += weight;
+    }
+
+    free(copy);
+    return (mix_total > 0);
+}
+
+/************************************************************************
+ * Pick the next command at random, according to the mix.
+ */
+static int pick_command(void) {
+    int r = rand() % mix_total;
+    for (int cmd = CMD_LOGIN + 1; cmd < NCMDS; cmd++) {
+        if (r < mix[cmd])
+            return cmd;
+        r -= mix[cmd];
+    }
+    return CMD_STAT;
+}
+
+/************************************************************************
+ * Send a line to the server. Commands are tiny, so they always fit in
+ * the socket buffer; anything else counts as a dropped connection.
+ */
+static int send_line(conn* c, const char* line, int len) {
+    ssize_t n = send(c->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return (n == len);
+}
+
+static void open_conn(conn* c);
+static void close_conn(conn* c);
+
+/************************************************************************
+ * Send connection "c" its next command (at random from the mix).
+ */
+static void next_command(conn* c) {
+    char line[128];
+    int len;
+    int cmd = pick_command();
+
+    switch (cmd) {
+    case CMD_MOVETO:
+        len = snprintf(line, sizeof(line), "MOVETO arena%d\n", rand() % 5);
+        break;
+    case CMD_MSG: {
+        conn* to = &conns[rand() % nconns];
+        if ((to == c) || (to->name[0] == '\0'))
+            to = (c == &conns[0]) ? &conns[nconns - 1] : &conns[0];
+        len = snprintf(line, sizeof(line), "MSG %s hello from %s\n",
+                       (to->name[0] != '\0') ? to->name : "nobody", c->name);
+        break;
+    }
+    case CMD_SAY:
+        len = snprintf(line, sizeof(line), "SAY hello from %s\n", c->name);
+        break;
+    default:
+        len = snprintf(line, sizeof(line), "%s\n", cmd_names[cmd]);
+        break;
+    }
+
+    c->cmd = cmd;
+    c->list_pending = 0;
+    c->start_ns = now_ns();
+    if (!send_line(c, line, len)) {
+        dropped++;
+        close_conn(c);
+        open_conn(c);
+    }
+}
+
+/************************************************************************
+ * Decide whether "line" is the answer to the command "c" is waiting for
+ * (rather than a notice that happened to arrive first). Sets "*err" if
+ * the answer is an error.
+ */
+static int is_response(conn* c, const char* line, int* err) {
+    *err = (strncmp(line, "ERR", 3) == 0);
+    if (*err)
+        return 1;
+
+    switch (c->cmd) {
+    case CMD_LOGIN:
+    case CMD_BYE:
+    case CMD_SAY:
+        return (strcmp(line, "OK") == 0);
+    case CMD_MOVETO:
+        return (strncmp(line, "Moved to ", 9) == 0);
+    case CMD_MSG: {
+        size_t nlen = strlen(c->name);
+        return ((strncmp(line, c->name, nlen) == 0) &&
+                (strncmp(line + nlen, ": ", 2) == 0)) ||
+               (strcmp(line, "Player Doesn't Exist") == 0);
+    }
+    case CMD_LIST:
+        return (strcmp(line, "OK") == 0);
+    case CMD_STAT:
+    case CMD_CREATE:
+        return (strncmp(line, "OK ", 3) == 0);
+    }
+    return 0;
+}
+
+/************************************************************************
+ * Handle one line from the server on connection "c".
+ */
+static void handle_line(conn* c, const char* line) {
+    if (c->state != CONN_WAITING)
+        return;
+
+    int err = 0;
+    if (c->list_pending) {
+        // The names that follow the "OK" of a LIST end the response
+        c->list_pending = 0;
+    } else if (!is_response(c, line, &err)) {
+        return;  // A notice -- not what we are waiting for
+    } else if ((c->cmd == CMD_LIST) && !err) {
+        c->list_pending = 1;
+        return;
+    }
+
+    record(&results[c->cmd], now_ns() - c->start_ns);
+    if (err)
+        results[c->cmd].errors++;
+
+    if (c->cmd == CMD_BYE) {
+        c->state = CONN_CLOSING;
+    } else if ((c->cmd == CMD_LOGIN) && err) {
+        // Name clash (shouldn't happen) -- try again as someone else
+        close_conn(c);
+        open_conn(c);
+    } else {
+        next_command(c);
+    }
+}
+
+/************************************************************************
+ * Read everything available on connection "c" and handle each complete
+ * line.
+ */
+static void handle_input(conn* c) {
+    for (;;) {
+        if (c->rlen == BENCH_RBUFSIZE)
+            c->rlen = 0;  // An absurdly long line -- just drop it
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, BENCH_RBUFSIZE - c->rlen,
+                         MSG_DONTWAIT);
+        if (n == 0) {
+            if (c->state != CONN_CLOSING)
+                dropped++;
+            close_conn(c);
+            open_conn(c);
+            return;
+        } else if (n < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return;
+            if (errno == EINTR)
+                continue;
+            dropped++;
+            close_conn(c);
+            open_conn(c);
+            return;
+        }
+
+        c->rlen += n;
+        char* start = c->rbuf;
+        char* end = c->rbuf + c->rlen;
+        char* nl;
+        int generation = c->generation;
+        while ((nl = memchr(start, '\n', end - start)) != NULL) {
+            *nl = '\0';
+            handle_line(c, start);
+            if (c->generation != generation)
+                return;  // Reconnected -- the rest of the buffer is gone
+            start = nl + 1;
+        }
+        c->rlen = end - start;
+        if ((c->rlen > 0) && (start != c->rbuf))
+            memmove(c->rbuf, start, c->rlen);
+    }
+}
+
+/************************************************************************
+ * Start a new connection in slot "c" (connecting is finished later, when
+ * epoll says the socket is writable).
+ */
+static void open_conn(conn* c) {
+    c->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CONN_CONNECTING;
+    c->rlen = 0;
+    c->name[0] = '\0';
+    c->generation++;
+    c->start_ns = now_ns();
+    if ((connect(c->fd, server->ai_addr, server->ai_addrlen) < 0) &&
+        (errno != EINPROGRESS)) {
+        perror("connect");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/************************************************************************
+ * Close the connection in slot "c".
+ */
+static void close_conn(conn* c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->name[0] = '\0';
+}
+
+/************************************************************************
+ * The connection in slot "c" has finished connecting (or failed): log
+ * in.
+ */
+static void connected(conn* c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        connect_failures++;
+        close_conn(c);
+        open_conn(c);
+        return;
+    }
+    record(&connects, now_ns() - c->start_ns);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    char line[64];
+    snprintf(c->name, sizeof(c->name), "b%dg%d", (int)(c - conns),
+             c->generation);
+    int n = snprintf(line, sizeof(line), "LOGIN %s\n", c->name);
+    c->state = CONN_WAITING;
+    c->cmd = CMD_LOGIN;
+    c->list_pending = 0;
+    c->start_ns = now_ns();
+    if (!send_line(c, line, n)) {
+        dropped++;
+        close_conn(c);
+        open_conn(c);
+    }
+}
+
+/************************************************************************
+ * Print a line of the report for one set of samples.
+ */
+static void report(const char* name, samples* s, double seconds) {
+    qsort(s->v, s->n, sizeof(long long), cmp_ll);
+    printf("%-8s %10zu %12.0f %10.1f %10.1f %10.1f %8lu\n", name, s->n,
+           s->n / seconds, quantile_us(s, 0.50), quantile_us(s, 0.99),
+           quantile_us(s, 0.999), s->errors);
+}
+
+/************************************************************************
+ * Print the command line options and exit.
+ */
+static void usage(char* progname) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] "
+            "[-d seconds] [-m mix]\n"
+            "  mix is a list of COMMAND=weight, default \"%s\"\n"
+            "  (commands: MOVETO MSG SAY LIST STAT CREATE BYE)\n",
+            progname, BENCH_MIX);
+    exit(1);
+}
+
+/************************************************************************
+ * Benchmark main: connect everybody, run the mix for the given time,
+ * then print the results.
+ */
+int main(int argc, char* argv[]) {
+    char* host = BENCH_HOST;
+    char* port = BENCH_PORT;
+    int seconds = BENCH_SECONDS;
+    nconns = BENCH_CONNS;
+    parse_mix(BENCH_MIX);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:m:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            if (nconns < 2)
+                usage(argv[0]);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            if (seconds < 1)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (!parse_mix(optarg))
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rval;
+    if ((rval = getaddrinfo(host, port, &hints, &server)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+        exit(1);
+    }
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if ((conns = calloc(nconns, sizeof(conn))) == NULL) {
+        perror("allocating connections");
+        exit(1);
+    }
+
+    srand(getpid());
+    long long start = now_ns();
+    long long deadline = start + seconds * 1000000000LL;
+    long long ramped = 0;  // When every connection had logged in
+    for (int i = 0; i < nconns; i++)
+        open_conn(&conns[i]);
+
+    struct epoll_event events[BENCH_MAXEVENTS];
+    long long now;
+    while ((now = now_ns()) < deadline) {
+        int n = epoll_wait(epfd, events, BENCH_MAXEVENTS, 100);
+        if ((n < 0) && (errno != EINTR)) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            conn* c = events[i].data.ptr;
+            if (c->state == CONN_CONNECTING)
+                connected(c);
+            else
+                handle_input(c);
+        }
+        if ((ramped == 0) && (results[CMD_LOGIN].n >= (size_t)nconns))
+            ramped = now_ns();
+    }
+    double elapsed = (now - start) / 1e9;
+
+    printf("%d connections for %.1f s against %s:%s\n", nconns, elapsed,
+           host, port);
+    if (ramped != 0)
+        printf("all connections logged in after %.3f s (%.0f/s)\n",
+               (ramped - start) / 1e9, nconns / ((ramped - start) / 1e9));
+    else
+        printf("not every connection managed to log in\n");
+    printf("%lu connections made (%.0f/s), %lu failed, %lu dropped\n\n",
+           (unsigned long)connects.n, connects.n / elapsed, connect_failures,
+           dropped);
+
+    printf("%-8s %10s %12s %10s %10s %10s %8s\n", "command", "count",
+           "per second", "p50 us", "p99 us", "p99.9 us", "errors");
+    unsigned long total = 0;
+    report("CONNECT", &connects, elapsed);
+    for (int cmd = 0; cmd < NCMDS; cmd++) {
+        if (results[cmd].n > 0)
+            report(cmd_names[cmd], &results[cmd], elapsed);
+        total += results[cmd].n;
+    }
+    printf("\n%lu responses, %.0f per second\n", total, total / elapsed);
+
+    for (int i = 0; i < nconns; i++)
+        close(conns[i].fd);
+    freeaddrinfo(server);
+    return 0;
+}
@@ -2,9 +2,13 @@
 
 // The protocol is fully defined in the README file. This module
 // includes functions to parse and perform commands sent by a
-// player (the docommand function), and has functions to send
-// responses to ensure proper and consistent formatting of these
-// messages.
+// player (the docommand function, or doframe for the binary protocol),
+// and has functions to send responses to ensure proper and consistent
+// formatting of these messages.
+//
+// Both protocols share the same command handlers: the binary requests
+// are decoded into the same arguments as the text ones, and each
+// response is sent in whichever protocol the player speaks.
 
 // This gives access to the asprintf function - helpful, but not portable!
 #define _GNU_SOURCE
@@ -13,17 +17,59 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "util.h"
 #include "player.h"
 #include "arena_protocol.h"
 #include "pllist.h"
+#include "room.h"
+#include "frame.h"
+#include "history.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Responses that never change, encoded once (by protocol_init) and
+// shared by reference
+
+static outmsg* text_ok;
+static outmsg* frame_ok;
+
+/************************************************************************
+ * protocol_init encodes the fixed responses. Should be called once at
+ * the beginning of main, when the program starts up.
+ */
+void protocol_init(void) {
+    text_ok = outmsg_format("OK\n");
+    frame_ok = frame_new(FRAME_OK, 0);
+}
+
+/************************************************************************
+ * Does the player speak the binary protocol?
+ */
+static inline int is_binary(player_info* player) {
+    return player->proto == PLAYER_BINARY;
+}
 
 /************************************************************************
  * Call this response function if a command was accepted
  */
 void send_ok(player_info* player) {
-    fprintf(player->fp_send, "OK\n");
+    player_queue(player, outmsg_ref(is_binary(player) ? frame_ok : text_ok));
+}
+
+/************************************************************************
+ * Call this response function if a command was accepted and the answer
+ * is a number (a room id): "OK <number>", or an OK frame carrying it.
+ */
+static void send_ok_number(player_info* player, uint32_t n) {
+    if (is_binary(player)) {
+        outmsg* m = frame_new(FRAME_OK, 4);
+        frame_put_u32(m->data + FRAME_HDRSIZE, n);
+        player_queue(player, m);
+    } else {
+        player_send(player, "OK %u\n", n);
+    }
 }
 
 /************************************************************************
@@ -31,7 +77,7 @@ void send_ok(player_info* player) {
  * string.
  */
 void send_notice(player_info* player, char* desc) {
-    fprintf(player->fp_send, "NOTICE %s\n", desc);
+    player_send(player, "NOTICE %s\n", desc);
 }
 
 /************************************************************************
@@ -39,7 +85,10 @@ void send_notice(player_info* player, char* desc) {
  * string.
  */
 void send_err(player_info* player, char* desc) {
-    fprintf(player->fp_send, "ERR %s\n", desc);
+    if (is_binary(player))
+        player_queue(player, frame_text(FRAME_ERR, desc, strlen(desc)));
+    else
+        player_send(player, "ERR %s\n", desc);
 }
 
 /************************************************************************
@@ -47,9 +96,9 @@ void send_err(player_info* player, char* desc) {
  * argument (sarg) into an error reply (which is now a format string).
  */
 void send_err_sarg(player_info* player, char* fmtstring, char* sarg) {
-    fprintf(player->fp_send, "ERR ");
-    fprintf(player->fp_send, fmtstring, sarg);
-    fprintf(player->fp_send, "\n");
+    char desc[256];
+    snprintf(desc, sizeof(desc), fmtstring, sarg);
+    send_err(player, desc);
 }
 
 /************************************************************************
@@ -57,206 +106,546 @@ void send_err_sarg(player_info* player, char* fmtstring, char* sarg) {
  * argument (sarg) into an error reply (which is now a format string).
  */
 void send_notice_sarg(player_info* player, char* fmtstring, char* sarg, char* sarg2) {
-    fprintf(player->fp_send, "NOTICE ");
-    fprintf(player->fp_send, fmtstring, sarg, sarg2);
-    fprintf(player->fp_send, "\n");
+    char desc[256];
+    snprintf(desc, sizeof(desc), fmtstring, sarg, sarg2);
+    player_send(player, "NOTICE %s\n", desc);
 }
 
 /************************************************************************
- * Handle the "LOGIN" command.
+ * Handle the "LOGIN" command. A binary client is told its player id.
  */
-static void cmd_login(player_info* player, char* arg1, char* rest) {
+static void cmd_login(player_info* player, span arg1, span rest) {
     if (player->state != PLAYER_UNREG) {
         send_err_sarg(player, "Already logged in as %s", player->name);
         return;
     }
 
-    if (arg1 == NULL) {
+    if (arg1.len == 0) {
         send_err(player, "LOGIN missing name");
         return;
     }
 
-    if (rest != NULL) {
+    if (rest.len != 0) {  // Only possible in text
         send_err(player, "LOGIN should have only one argument");
         return;
     }
 
-    char* cp = arg1;
-    while (*cp != '\0') {
-        if (!isalnum(*cp)) {
+    for (int i = 0; i < arg1.len; i++) {
+        if (!isalnum((unsigned char)arg1.p[i])) {
             send_err(player, "Invalid name -- only alphanumeric characters allowed");
             return;
         }
-        cp++;
     }
 
-    if (strlen(arg1) > PLAYER_MAXNAME) {
+    if (arg1.len > PLAYER_MAXNAME) {
         send_err(player, "Invalid name -- too long");
         return;
     }
 
-    // Check for a duplicate name - not O(1) time but only done at login
+    char name[PLAYER_MAXNAME+1];
+    memcpy(name, arg1.p, arg1.len);
+    name[arg1.len] = '\0';
+
     // player_addifnew() is an atomic check-and-set
 
-    if (pllist_addifnew(player, arg1)) {
+    if (pllist_addifnew(player, name)) {
         player->state = PLAYER_REG;
-        send_ok(player);
+        if (is_binary(player)) {
+            outmsg* m = frame_new(FRAME_OK, 8);
+            frame_put_u64(m->data + FRAME_HDRSIZE, player->handle);
+            player_queue(player, m);
+        } else {
+            send_ok(player);
+        }
     } else {
         send_err(player, "Invalid name -- already in use");
     }
 }
 
 /************************************************************************
- * Handle the "MOVETO" command.
+ * Parse a room id, either bare ("17") or with an "arena" prefix
+ * ("arena17"). Returns -1 if it isn't a number.
+ */
+static int parse_room(span arg) {
+    int i = 0;
+    if ((arg.len > 5) && (memcmp(arg.p, "arena", 5) == 0))
+        i = 5;
+    if ((i == arg.len) || (arg.len - i > 9))
+        return -1;
+
+    int room = 0;
+    for (; i < arg.len; i++) {
+        if (!isdigit((unsigned char)arg.p[i]))
+            return -1;
+        room = room * 10 + (arg.p[i] - '0');
+    }
+    return room;
+}
+
+/************************************************************************
+ * Move the player to room "room" (-1 if the request didn't name a valid
+ * room id), for either protocol's MOVETO.
  */
-static void cmd_moveto(player_info* player, char* arg1, char* rest) {
+static void do_moveto(player_info* player, int room) {
     if (player->state == PLAYER_UNREG) {
         send_err(player, "Player must be logged in before MOVETO");
         return;
     }
-    //Announces the departure of the player
-    pllist_announce_departure(player);
-    if (arg1 == NULL) {
-        send_err(player, "No Room Selected.");
-
-    } else if (strcmp(arg1, "arena0") == 0) {
-        fprintf(player->fp_send, "Moved to Lobby\n");
-        player->in_room = 0;
-
-    } else if (strcmp(arg1, "arena1") == 0) {
-        fprintf(player->fp_send, "Moved to Arena 1\n");
-        player->in_room = 1;
-
-    } else if (strcmp(arg1, "arena2") == 0) {
-        fprintf(player->fp_send, "Moved to Arena 2\n");
-        player->in_room = 2;
 
-    } else if (strcmp(arg1, "arena3") == 0) {
-        fprintf(player->fp_send, "Moved to Arena 3\n");
-        player->in_room = 3;
-
-    } else if (strcmp(arg1, "arena4") == 0) {
-        fprintf(player->fp_send, "Moved to Arena 4\n");
-        player->in_room = 4;
+    // Moves it in the index, then announces the departure of the player
+    int from = player->in_room;
+    if ((room < 0) || !pllist_moveto(player, room)) {
+        send_err(player, "Invalid arena!");
+        return;
+    }
+    pllist_announce_departure(player, from);
 
+    if (is_binary(player)) {
+        send_ok_number(player, room);
+    } else if (room == ROOM_LOBBY) {
+        player_send(player, "Moved to Lobby\n");
     } else {
-        send_err(player, "Invalid arena!");
+        player_send(player, "Moved to Arena %d\n", room);
     }
 
     //Announces the arrival of the player
     pllist_announce_arrival(player);
+}
+
+/************************************************************************
+ * Handle the "MOVETO" command.
+ */
+static void cmd_moveto(player_info* player, span arg1, span rest) {
+    if ((arg1.len == 0) && (player->state != PLAYER_UNREG)) {
+        send_err(player, "No Room Selected.");
+        return;
+    }
+    do_moveto(player, parse_room(arg1));
+}
 
-    // Hint for future implementation (not needed until part 3): Look
-    // into the strtol() function for turning the string argument into
-    // a number, with error checking.
+/************************************************************************
+ * Handle the "CREATE" command.
+ */
+static void cmd_create(player_info* player, span arg1, span rest) {
+    if (player->state == PLAYER_UNREG) {
+        send_err(player, "Player must be logged in before CREATE");
+        return;
+    }
+
+    int from = player->in_room;
+    int room = pllist_create(player);
+    if (room == -1) {
+        send_err(player, "Too many arenas");
+        return;
+    } else if (room < 0) {
+        send_err(player, "New arena was taken away -- try again");
+        return;
+    }
+    pllist_announce_departure(player, from);
+    send_ok_number(player, room);
+    pllist_announce_arrival(player);
 }
 
 /************************************************************************
- * Handle the "MSG" command.
+ * Send message "text" to another player, for either protocol's MSG: to
+ * the one named "to" (text), or if "to" is NULL, to the one whose id is
+ * "to_id" (binary).
  */
-static void cmd_msg(player_info* player, char* arg1, char* rest) {
+static void do_msg(player_info* player, span* to, uint64_t to_id, span text) {
     if (player->state == PLAYER_UNREG) {
         send_err(player, "Player must be logged in before MSG");
         return;
     }
+
+    if (((to != NULL) && (to->len == 0)) || (text.len == 0)) {
+        send_err(player, "MSG requires a name and a message");
+        return;
+    }
+
+    // A text line can't hold a newline, but a frame can -- and it would
+    // let a binary client forge lines to text clients
+    if (memchr(text.p, '\n', text.len) != NULL) {
+        send_err(player, "Invalid message");
+        return;
+    }
+
     // Add a check to make sure player isnt trying to message themself
-    if (strcmp(arg1, player->name) == 0) {
+    if ((to != NULL) ? span_eq(*to, player->name) : (to_id == player->handle)) {
         send_err(player, "Player cannot MSG self");
+        return;
     }
-    // If they arent a check is made to see if the player in question exists
-    if (!pllist_addifnew(player, arg1)) {
-        player_info* player2 = pllist_link(arg1);
-        send_notice_sarg(player2, "From %s: %s", player->name, rest);
-        fprintf(player->fp_send, "%s: %s\n", player->name, rest);
 
-        // If they do not it is returned
+    // Hash lookup and delivery in one step -- no scan, no write lock
+    int sent;
+    if (to != NULL) {
+        // No registered player can have a longer name than this
+        char name[PLAYER_MAXNAME+1] = "";
+        if (to->len <= PLAYER_MAXNAME) {
+            memcpy(name, to->p, to->len);
+            name[to->len] = '\0';
+        }
+        sent = (name[0] != '\0') && pllist_message(player, name, text.p, text.len);
     } else {
-        fprintf(player->fp_send, "Player Doesn't Exist\n");
+        sent = pllist_message_id(player, to_id, text.p, text.len);
+    }
+
+    if (is_binary(player)) {
+        if (sent)
+            send_ok(player);
+        else
+            send_err(player, "Player Doesn't Exist");
+    } else if (sent) {
+        player_send(player, "%s: %.*s\n", player->name, text.len, text.p);
+    } else {
+        // If they do not exist it is returned
+        player_send(player, "Player Doesn't Exist\n");
     }
 }
 
+/************************************************************************
+ * Handle the "MSG" command.
+ */
+static void cmd_msg(player_info* player, span arg1, span rest) {
+    do_msg(player, &arg1, 0, rest);
+}
+
+/************************************************************************
+ * Send message "text" to everyone else in the player's room, for either
+ * protocol's SAY.
+ */
+static void do_say(player_info* player, span text) {
+    if (player->state == PLAYER_UNREG) {
+        send_err(player, "Player must be logged in before SAY");
+        return;
+    }
+
+    if (text.len == 0) {
+        send_err(player, "SAY requires a message");
+        return;
+    }
+
+    // As for MSG, a frame mustn't be able to forge lines
+    if (memchr(text.p, '\n', text.len) != NULL) {
+        send_err(player, "Invalid message");
+        return;
+    }
+
+    pllist_say(player, text.p, text.len);
+    send_ok(player);
+}
+
+/************************************************************************
+ * Handle the "SAY" command. The message is the whole rest of the line.
+ */
+static void cmd_say(player_info* player, span arg1, span rest) {
+    span text = { arg1.p, 0 };
+    if (arg1.len > 0)
+        text.len = ((rest.len > 0) ? rest.p + rest.len : arg1.p + arg1.len) - arg1.p;
+    do_say(player, text);
+}
+
 /************************************************************************
  * Handle the "STAT" command.
  */
-static void cmd_stat(player_info* player, char* arg1, char* rest) {
+static void cmd_stat(player_info* player, span arg1, span rest) {
     if (player->state == PLAYER_UNREG) {
         send_err(player, "");
         return;
     }
-    fprintf(player->fp_send, "OK %d\n", player->in_room);
+    send_ok_number(player, player->in_room);
 }
 
 /************************************************************************
- * Handle the "LIST" command.
+ * List the players in the player's room, for either protocol's LIST:
+ * all of them, or if "since" isn't NULL, just the changes since that
+ * roster version (if the room still remembers them).
  */
-static void cmd_list(player_info* player, char* arg1, char* rest) {
+static void do_list(player_info* player, const uint64_t* since) {
     if (player->state == PLAYER_UNREG) {
         send_err(player, "Player must be logged in before LIST");
         return;
     }
-    fprintf(player->fp_send, "OK\n");
-    pllist_list(player);
-    fprintf(player->fp_send, "\n");
+    if (is_binary(player)) {
+        roster* r = room_snapshot(player->in_room);
+        player_queue(player, (since == NULL) ? frame_roster(r) :
+                                               frame_roster_since(r, *since));
+        return;
+    }
+    if (since == NULL) {
+        char* names = pllist_list(player);
+        player_send(player, "OK\n%s\n", names);
+        free(names);
+        return;
+    }
+    uint64_t version;
+    char* list = pllist_list_since(player, *since, &version);
+    player_send(player, "OK %lu\n%s\n", (unsigned long)version, list);
+    free(list);
+}
+
+/************************************************************************
+ * Parse a roster version (a decimal number). Returns false if "arg"
+ * isn't one.
+ */
+static int parse_version(span arg, uint64_t* version) {
+    if ((arg.len == 0) || (arg.len > 20))
+        return 0;
+
+    uint64_t v = 0;
+    for (int i = 0; i < arg.len; i++) {
+        if (!isdigit((unsigned char)arg.p[i]))
+            return 0;
+        int digit = arg.p[i] - '0';
+        if (v > (UINT64_MAX - digit) / 10)
+            return 0;
+        v = v * 10 + digit;
+    }
+    *version = v;
+    return 1;
+}
+
+/************************************************************************
+ * Handle the "LIST" command.
+ */
+static void cmd_list(player_info* player, span arg1, span rest) {
+    uint64_t since;
+    if (arg1.len == 0)
+        do_list(player, NULL);
+    else if (parse_version(arg1, &since) && (rest.len == 0))
+        do_list(player, &since);
+    else
+        send_err(player, "Invalid roster version");
+}
+
+/************************************************************************
+ * Handle the "HISTORY" command: the latest messages said in the player's
+ * room.
+ */
+static void cmd_history(player_info* player, span arg1, span rest) {
+    if (player->state == PLAYER_UNREG) {
+        send_err(player, "Player must be logged in before HISTORY");
+        return;
+    }
+    player_queue(player, history_recent(player->in_room, is_binary(player)));
 }
 
 /************************************************************************
  * Handle the "BYE" command.
  */
-static void cmd_bye(player_info* player, char* arg1, char* rest) {
-    pllist_announce_departure(player);
+static void cmd_bye(player_info* player, span arg1, span rest) {
+    pllist_leave(player);
     player->state = PLAYER_DONE;
     send_ok(player);
 }
 
+// Every command handler gets the first word after the command ("arg1")
+// and the rest of the line after that, trimmed ("rest"). Either may be
+// empty.
+
+typedef void (*cmd_handler)(player_info* player, span arg1, span rest);
+
+// Every command, indexed by the id its timings are recorded under (see
+// metrics.h)
+
+typedef struct {
+    const char* verb;
+    cmd_handler handler;
+} command;
+
+static const command commands[METRIC_NVERBS] = {
+    [METRIC_VERB_LOGIN] = { "LOGIN", cmd_login },
+    [METRIC_VERB_MOVETO] = { "MOVETO", cmd_moveto },
+    [METRIC_VERB_CREATE] = { "CREATE", cmd_create },
+    [METRIC_VERB_MSG] = { "MSG", cmd_msg },
+    [METRIC_VERB_STAT] = { "STAT", cmd_stat },
+    [METRIC_VERB_LIST] = { "LIST", cmd_list },
+    [METRIC_VERB_BYE] = { "BYE", cmd_bye },
+    [METRIC_VERB_SAY] = { "SAY", cmd_say },
+    [METRIC_VERB_HISTORY] = { "HISTORY", cmd_history },
+};
+
+/************************************************************************
+ * Find command "cmd", or NULL if there isn't one. The
+ * length and first letter narrow it down to at most one candidate, so
+ * only one string compare is ever done.
+ */
+static const command* find_command(span cmd) {
+    const command* c;
+
+    switch (cmd.len) {
+    case 3:
+        switch (cmd.p[0]) {
+        case 'M': c = &commands[METRIC_VERB_MSG]; break;
+        case 'B': c = &commands[METRIC_VERB_BYE]; break;
+        case 'S': c = &commands[METRIC_VERB_SAY]; break;
+        default: return NULL;
+        }
+        break;
+    case 4:
+        switch (cmd.p[0]) {
+        case 'S': c = &commands[METRIC_VERB_STAT]; break;
+        case 'L': c = &commands[METRIC_VERB_LIST]; break;
+        default: return NULL;
+        }
+        break;
+    case 5:
+        c = &commands[METRIC_VERB_LOGIN];
+        break;
+    case 6:
+        switch (cmd.p[0]) {
+        case 'M': c = &commands[METRIC_VERB_MOVETO]; break;
+        case 'C': c = &commands[METRIC_VERB_CREATE]; break;
+        default: return NULL;
+        }
+        break;
+    case 7:
+        c = &commands[METRIC_VERB_HISTORY];
+        break;
+    default:
+        return NULL;
+    }
+
+    return (memcmp(cmd.p, c->verb, cmd.len) == 0) ? c : NULL;
+}
+
+/************************************************************************
+ * Is "c" a separator between words?
+ */
+static inline int is_blank(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
 /************************************************************************
  * Parses and performs the actions in the line of text (command and
- * optionally arguments) passed in as "command".
+ * optionally arguments) passed in as "line", which is "len" bytes long
+ * and doesn't include the newline.
+ *
+ * The line is split in a single pass into spans pointing into the
+ * caller's buffer -- nothing is copied and the buffer isn't modified.
  */
-void docommand(player_info* player, char* command) {
-    char* saveptr;
-    char* cmd = strtok_r(command, " \t\r\n", &saveptr);
-    if (cmd == NULL) {  // Empty line (no command) -- just ignore line
+void docommand(player_info* player, const char* line, size_t len) {
+    const char* cp = line;
+    const char* end = line + len;
+    span cmd, arg1 = { NULL, 0 }, rest = { NULL, 0 };
+
+    while ((cp < end) && is_blank(*cp))
+        cp++;
+    cmd.p = cp;
+    while ((cp < end) && !is_blank(*cp))
+        cp++;
+    cmd.len = cp - cmd.p;
+    if (cmd.len == 0) {  // Empty line (no command) -- just ignore line
         return;
     }
 
     // Get first argument (if there is one)
-    char* arg1 = strtok_r(NULL, " \r\n", &saveptr);
-    if (arg1 != NULL) {
-        // Don't consider an empty string an argument....
-        if (arg1[0] == '\0')
-            arg1 = NULL;
-    }
+    while ((cp < end) && is_blank(*cp))
+        cp++;
+    arg1.p = cp;
+    while ((cp < end) && !is_blank(*cp))
+        cp++;
+    arg1.len = cp - arg1.p;
 
     // Get the rest (if present -- trimmed)
-    char* rest = NULL;
-    if (arg1 != NULL) {
-        rest = strtok_r(NULL, "\r\n", &saveptr);
-        if (rest != NULL) {
-            rest = trim(rest);
-            // Don't consider an empty string an argument....
-            if (rest[0] == '\0')
-                rest = NULL;
-        }
+    while ((cp < end) && isspace((unsigned char)*cp))
+        cp++;
+    while ((end > cp) && isspace((unsigned char)end[-1]))
+        end--;
+    rest.p = cp;
+    rest.len = end - cp;
+
+    unsigned long start = metrics_now();
+    TRACE_START(trace_start);
+    const command* c = find_command(cmd);
+    if (c != NULL) {
+        c->handler(player, arg1, rest);
+    } else {
+        send_err(player, "Unknown command");
     }
+    int verb = (c != NULL) ? c - commands : METRIC_VERB_UNKNOWN;
+    TRACE_END(trace_start, TRACE_COMMAND, verb);
+    metrics_observe(verb, metrics_now() - start);
+}
 
-    // Parsing result: "cmd" has the command string, "arg1" has the
-    // next word after "cmd" if it exists (NULL if not), and "rest"
-    // has the rest of line after the first argument (NULL if not
-    // present).
-
-    if (strcmp(cmd, "LOGIN") == 0) {
-        cmd_login(player, arg1, rest);
-    } else if (strcmp(cmd, "MOVETO") == 0) {
-        cmd_moveto(player, arg1, rest);
-    } else if (strcmp(cmd, "MSG") == 0) {
-        cmd_msg(player, arg1, rest);
-    } else if (strcmp(cmd, "STAT") == 0) {
-        cmd_stat(player, arg1, rest);
-    } else if (strcmp(cmd, "LIST") == 0) {
-        cmd_list(player, arg1, rest);
-    } else if (strcmp(cmd, "BYE") == 0) {
-        cmd_bye(player, arg1, rest);
-    } else {
+/************************************************************************
+ * Performs the binary request "op" with "len" bytes of "payload" (see
+ * frame.h). Requests are decoded into the same arguments the text
+ * commands are parsed into, and run by the same handlers.
+ */
+void doframe(player_info* player, int op, const char* payload, size_t len) {
+    span none = { NULL, 0 };
+    span data = { payload, len };
+    int verb;
+
+    unsigned long start = metrics_now();
+    TRACE_START(trace_start);
+    switch (op) {
+    case FRAME_OP_LOGIN:
+        verb = METRIC_VERB_LOGIN;
+        cmd_login(player, data, none);
+        break;
+    case FRAME_OP_MOVETO:
+        verb = METRIC_VERB_MOVETO;
+        if ((len == 4) && (frame_get_u32(payload) <= INT_MAX))
+            do_moveto(player, frame_get_u32(payload));
+        else
+            do_moveto(player, -1);
+        break;
+    case FRAME_OP_CREATE:
+        verb = METRIC_VERB_CREATE;
+        cmd_create(player, none, none);
+        break;
+    case FRAME_OP_MSG:
+        verb = METRIC_VERB_MSG;
+        if (len < 8) {
+            send_err(player, "MSG requires a player id and a message");
+            break;
+        }
+        span text = { payload + 8, len - 8 };
+        do_msg(player, NULL, frame_get_u64(payload), text);
+        break;
+    case FRAME_OP_STAT:
+        verb = METRIC_VERB_STAT;
+        cmd_stat(player, none, none);
+        break;
+    case FRAME_OP_LIST:
+        verb = METRIC_VERB_LIST;
+        if (len == 0) {
+            do_list(player, NULL);
+        } else if (len == 8) {
+            uint64_t since = frame_get_u64(payload);
+            do_list(player, &since);
+        } else {
+            send_err(player, "Invalid roster version");
+        }
+        break;
+    case FRAME_OP_BYE:
+        verb = METRIC_VERB_BYE;
+        cmd_bye(player, none, none);
+        break;
+    case FRAME_OP_SAY:
+        verb = METRIC_VERB_SAY;
+        do_say(player, data);
+        break;
+    case FRAME_OP_HISTORY:
+        verb = METRIC_VERB_HISTORY;
+        cmd_history(player, none, none);
+        break;
+    default:
+        verb = METRIC_VERB_UNKNOWN;
         send_err(player, "Unknown command");
     }
+    TRACE_END(trace_start, TRACE_COMMAND, verb);
+    metrics_observe(verb, metrics_now() - start);
+}
+
+/************************************************************************
+ * protocol_abort ends a connection whose input can't be made sense of
+ * (such as a frame too big to ever be read), after telling the client
+ * why. The player leaves the game as if it had sent BYE.
+ */
+void protocol_abort(player_info* player, char* desc) {
+    send_err(player, desc);
+    pllist_leave(player);
+    player->state = PLAYER_DONE;
 }
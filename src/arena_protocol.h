@@ -3,8 +3,13 @@
 #ifndef _ARENA_COMMANDS_H
 #define _ARENA_COMMANDS_H
 
+#include <stddef.h>
+
 #include "player.h"
 
-void docommand(player_info* player, char* command);
+void protocol_init(void);
+void docommand(player_info* player, const char* line, size_t len);
+void doframe(player_info* player, int op, const char* payload, size_t len);
+void protocol_abort(player_info* player, char* desc);
 
 #endif  // _ARENA_COMMANDS_H
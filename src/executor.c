@@ -0,0 +1,513 @@
+// The executor module runs players' commands on a pool of worker threads.
+
+// By default a reactor runs each command itself, straight out of the
+// read buffer (see reactor.c), so a slow command -- a LIST of a crowded
+// room, say, or a wait for a busy lock -- holds up every other
+// connection on that reactor. With workers (executor_start), the
+// reactors only read: they split the input into complete commands, copy
+// them into the player's command queue, and go back to their sockets.
+// The commands are run here.
+//
+// A player is the unit of work. When commands arrive for a player that
+// isn't already scheduled, the player goes on one worker's deque, and
+// whichever worker takes it off runs everything queued for it by then,
+// so one player's commands are never run by two threads at once and
+// always run in the order they arrived. Each worker takes players from
+// its own deque first (oldest first, so nobody starves); a worker with
+// nothing to do steals from the others (newest first, so the owner and
+// the thief rarely meet), so the work spreads over whichever cores are
+// free, and the reactors can be kept to a few threads.
+//
+// The reactor still owns the connection. A worker tells it (through the
+// "wake" callback) when it can read from a paused player again, and
+// when a player it is waiting to close has no commands left, since the
+// player must not be removed while a worker may still run one of its
+// commands. Everything else between the two goes through the player's
+// queue and its lock.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rcu.h"
+#include "metrics.h"
+#include "player.h"
+#include "pllist.h"
+#include "arena_protocol.h"
+#include "frame.h"
+#include "executor.h"
+
+// A worker's deque of players waiting to be run: a ring of "capacity"
+// slots, of which "count" starting at "head" are in use.
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    player_info** items;
+    int head;
+    int count;
+    int capacity;
+} deque;
+
+static deque* deques;
+static int nworkers;
+static unsigned long tick_ns;
+static void (*wake)(player_info* player);
+
+// Idle workers sleep on idle_cond until a player is put on any deque
+// ("queued" counts them all)
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+static atomic_int queued;
+static atomic_int nidle;
+
+/***********************************************************************
+ * Put a player on the end of deque "d".
+ */
+static void push(deque* d, player_info* player) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->capacity) {
+        int capacity = (d->capacity > 0) ? d->capacity * 2 : 64;
+        player_info** items = malloc(capacity * sizeof(player_info*));
+        if (items == NULL) {
+            perror("executor");
+            exit(1);
+        }
+        for (int i = 0; i < d->count; i++)
+            items[i] = d->items[(d->head + i) % d->capacity];
+        free(d->items);
+        d->items = items;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    d->items[(d->head + d->count) % d->capacity] = player;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/***********************************************************************
+ * Take the oldest player off deque "d" (its owner does this), or the
+ * newest ("steal" set, for other workers). NULL if it is empty.
+ */
+static player_info* pop(deque* d, int steal) {
+    player_info* player = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        if (steal) {
+            player = d->items[(d->head + d->count - 1) % d->capacity];
+        } else {
+            player = d->items[d->head];
+            d->head = (d->head + 1) % d->capacity;
+        }
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return player;
+}
+
+/***********************************************************************
+ * Put a player on worker "w"'s deque to be run, waking an idle worker
+ * (any one -- if it isn't "w", it steals the player).
+ */
+static void schedule(player_info* player, int w) {
+    push(&deques[w], player);
+    atomic_fetch_add(&queued, 1);
+    if (atomic_load(&nidle) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/***********************************************************************
+ * Find worker "w" a player to run: from its own deque if it can, or
+ * else stolen from another worker's. NULL if there are none anywhere.
+ */
+static player_info* take(int w) {
+    player_info* player = pop(&deques[w], 0);
+    for (int i = 1; (player == NULL) && (i < nworkers); i++) {
+        if ((player = pop(&deques[(w + i) % nworkers], 1)) != NULL)
+            metrics_count(METRIC_STEALS, 1);
+    }
+    if (player != NULL)
+        atomic_fetch_sub(&queued, 1);
+    return player;
+}
+
+/***********************************************************************
+ * Free a list of queued commands.
+ */
+static void free_cmds(cmdbuf* b) {
+    while (b != NULL) {
+        cmdbuf* next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+/***********************************************************************
+ * Run the commands in "b", from where the last run stopped. Returns
+ * false if it has to stop because the player's responses are piling up
+ * faster than its client reads them (as the reactor does when it runs
+ * commands itself), true once they have all run or the player has left.
+ */
+static int run_cmds(player_info* player, cmdbuf* b) {
+    if (b->kind == CMD_TOOLONG) {
+        player_send(player, "ERR Line too long\n");
+        return 1;
+    }
+    if (b->kind == CMD_ABORT) {
+        protocol_abort(player, "Frame too long");
+        return 1;
+    }
+
+    while ((b->off < b->len) && (player->state != PLAYER_DONE)) {
+        if (player_backlogged(player)) {
+            player_flush(player);
+            if (player_backlogged(player))
+                return 0;
+        }
+
+        char* start = b->data + b->off;
+        if (b->kind == CMD_TEXT) {
+            char* nl = memchr(start, '\n', b->len - b->off);
+            docommand(player, start, nl - start);
+            b->off = nl + 1 - b->data;
+        } else {
+            size_t len = frame_get_u32(start);
+            doframe(player, (unsigned char)start[4], start + FRAME_HDRSIZE, len);
+            b->off += FRAME_HDRSIZE + len;
+        }
+    }
+    return 1;
+}
+
+/***********************************************************************
+ * Run everything queued for a player (worker "w" took it off a deque).
+ * Its responses are written together at the end, as when the reactor
+ * runs a batch. Afterwards the player goes back on the deque if more
+ * has arrived meanwhile, or is left until its output drains if it
+ * stalled; otherwise it is no longer scheduled, and from then on its
+ * reactor may close it -- so this is the last we touch it until this
+ * worker's next quiescent state.
+ */
+static void run_player(int w, player_info* player) {
+    cmdq* q = &player->cmds;
+    pthread_mutex_lock(&q->lock);
+    cmdbuf* list = q->head;
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+    q->worker = w;
+    int paused = q->paused;
+    q->paused = 0;
+    pthread_mutex_unlock(&q->lock);
+    if (paused)
+        wake(player);  // There is room in its queue again
+
+    player_cork(player);
+    while ((list != NULL) && run_cmds(player, list)) {
+        cmdbuf* next = list->next;
+        free(list);
+        list = next;
+    }
+    player_uncork(player);
+
+    int done = (player->state == PLAYER_DONE);
+    if (done) {
+        free_cmds(list);
+        list = NULL;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (list != NULL) {
+        // Stalled: put back what is left, in front of anything newer
+        cmdbuf* last = list;
+        q->bytes += last->len - last->off;
+        while (last->next != NULL) {
+            last = last->next;
+            q->bytes += last->len;
+        }
+        last->next = q->head;
+        if (q->head == NULL)
+            q->tail = last;
+        q->head = list;
+        q->stalled = 1;
+        q->scheduled = 0;
+    } else if (done) {
+        free_cmds(q->head);
+        q->head = q->tail = NULL;
+        q->bytes = 0;
+        q->finished = 1;
+        q->scheduled = 0;
+    } else if (q->head == NULL) {
+        q->scheduled = 0;
+    }
+    int again = q->scheduled;
+    int notify = !again && (q->waiting || done);
+    if (notify)
+        q->waiting = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    if (again)
+        schedule(player, w);
+    else if (notify)
+        wake(player);
+    else if (list != NULL)
+        executor_resume(player);  // In case it drained before we stalled
+}
+
+/***********************************************************************
+ * Wait until there is a player to run, or (in tick mode) until the tick
+ * at "next_tick" is due. Offline meanwhile, like an idle reactor.
+ */
+static void idle(unsigned long next_tick) {
+    rcu_thread_offline();
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&nidle, 1);
+    while (atomic_load(&queued) == 0) {
+        if (tick_ns == 0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+            continue;
+        }
+        if (metrics_now() >= next_tick)
+            break;
+        struct timespec ts;
+        ts.tv_sec = next_tick / 1000000000UL;
+        ts.tv_nsec = next_tick % 1000000000UL;
+        if (pthread_cond_timedwait(&idle_cond, &idle_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    atomic_fetch_sub(&nidle, 1);
+    pthread_mutex_unlock(&idle_lock);
+    rcu_thread_online();
+}
+
+/***********************************************************************
+ * Thread start function for worker number "arg". Like a reactor, it
+ * writes what it has queued for other players after every player it
+ * runs (or once per tick, in tick mode), and passes through an RCU
+ * quiescent state each time round.
+ */
+static void* worker_thread(void* arg) {
+    int w = (long)arg;
+    rcu_register_thread();
+    unsigned long next_tick = metrics_now() + tick_ns;
+    while (1) {
+        player_info* player = take(w);
+        if (player != NULL)
+            run_player(w, player);
+        else
+            idle(next_tick);
+
+        if (tick_ns == 0) {
+            pllist_flush_pending();
+        } else if (metrics_now() >= next_tick) {
+            pllist_flush_pending();
+            next_tick += tick_ns;
+            if (next_tick < metrics_now())
+                next_tick = metrics_now() + tick_ns;  // Fell behind
+        }
+        rcu_quiescent();
+    }
+    return NULL;
+}
+
+/***********************************************************************
+ * executor_start starts "count" command workers (none, the default,
+ * leaves the reactors running commands themselves). "tick_ms" is the
+ * tick length, as given to reactor_configure, and "wake" is how a
+ * worker asks a player's reactor to look at it again (see above). Must
+ * be called before any reactor starts.
+ */
+void executor_start(int count, int tick_ms, void (*wake_fn)(player_info* player)) {
+    nworkers = count;
+    tick_ns = tick_ms * 1000000UL;
+    wake = wake_fn;
+    if (count == 0)
+        return;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&idle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ((deques = aligned_alloc(64, count * sizeof(deque))) == NULL) {
+        perror("executor_start");
+        exit(1);
+    }
+    memset(deques, 0, count * sizeof(deque));
+    for (int i = 0; i < count; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, (void*)(long)i) != 0) {
+            fprintf(stderr, "Couldn't start command worker.\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+}
+
+/***********************************************************************
+ * executor_workers is the number of command workers, 0 if the reactors
+ * run commands themselves.
+ */
+int executor_workers(void) {
+    return nworkers;
+}
+
+/***********************************************************************
+ * cmdq_init sets up an empty command queue (for a new player), and
+ * cmdq_destroy frees one and whatever is left in it.
+ */
+void cmdq_init(cmdq* q) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+    q->worker = -1;
+    q->scheduled = 0;
+    q->stalled = 0;
+    q->paused = 0;
+    q->finished = 0;
+    q->waiting = 0;
+}
+
+void cmdq_destroy(cmdq* q) {
+    free_cmds(q->head);
+    q->head = q->tail = NULL;
+    pthread_mutex_destroy(&q->lock);
+}
+
+/***********************************************************************
+ * executor_submit queues "len" bytes of complete commands of the given
+ * kind (CMD_TEXT or CMD_FRAMES; nothing for the other kinds) to be run
+ * for the player, and schedules it if it isn't already. Called by the
+ * player's reactor. Returns true if the player now has so much queued
+ * that the reactor should stop reading from it, until the worker that
+ * takes the queue wakes it.
+ */
+int executor_submit(player_info* player, int kind, const char* data,
+                    size_t len) {
+    cmdbuf* b = malloc(sizeof(cmdbuf) + len);
+    if (b == NULL) {
+        perror("executor_submit");
+        exit(1);
+    }
+    b->next = NULL;
+    b->kind = kind;
+    b->len = len;
+    b->off = 0;
+    memcpy(b->data, data, len);
+
+    cmdq* q = &player->cmds;
+    pthread_mutex_lock(&q->lock);
+    if (q->finished) {
+        pthread_mutex_unlock(&q->lock);
+        free(b);  // Nobody is listening any more
+        return 0;
+    }
+    if (q->tail != NULL)
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+    q->bytes += len;
+
+    int run = !q->scheduled && !q->stalled;
+    if (run) {
+        q->scheduled = 1;
+        if (q->worker < 0)
+            q->worker = player->handle % nworkers;
+    }
+    int full = (q->bytes >= EXECUTOR_MAXQUEUED);
+    if (full)
+        q->paused = 1;
+    int w = q->worker;
+    pthread_mutex_unlock(&q->lock);
+
+    if (run)
+        schedule(player, w);
+    return full;
+}
+
+/***********************************************************************
+ * executor_resume schedules a player whose commands were stopped for
+ * its output to drain, if it has. Called by its reactor whenever the
+ * socket takes more output.
+ */
+void executor_resume(player_info* player) {
+    cmdq* q = &player->cmds;
+    pthread_mutex_lock(&q->lock);
+    int run = q->stalled && !player_backlogged(player);
+    if (run) {
+        q->stalled = 0;
+        q->scheduled = 1;
+    }
+    int w = q->worker;
+    pthread_mutex_unlock(&q->lock);
+    if (run)
+        schedule(player, w);
+}
+
+/***********************************************************************
+ * executor_paused is true while the reactor should not read from the
+ * player, because too much of its input is waiting to be run.
+ */
+int executor_paused(player_info* player) {
+    pthread_mutex_lock(&player->cmds.lock);
+    int paused = player->cmds.paused;
+    pthread_mutex_unlock(&player->cmds.lock);
+    return paused;
+}
+
+/***********************************************************************
+ * executor_finished is true once the player has left (BYE, or a
+ * protocol error), and its connection can be closed.
+ */
+int executor_finished(player_info* player) {
+    pthread_mutex_lock(&player->cmds.lock);
+    int finished = player->cmds.finished;
+    pthread_mutex_unlock(&player->cmds.lock);
+    return finished;
+}
+
+/***********************************************************************
+ * executor_quiesce is called by the reactor when it wants to close a
+ * player. Returns true if that is safe now: no worker is running the
+ * player's commands or has any left to run, and none ever will.
+ * Otherwise they are run first, as the reactor would have run them
+ * before it read on to the end of the input -- one stalled for its
+ * output to drain is nudged, in case the socket has taken it meanwhile
+ * (or is broken, so its output is thrown away) -- and the reactor is
+ * woken once they are done.
+ */
+int executor_quiesce(player_info* player) {
+    if (nworkers == 0)
+        return 1;
+
+    cmdq* q = &player->cmds;
+    pthread_mutex_lock(&q->lock);
+    int idle = !q->scheduled && !q->stalled;
+    if (idle) {
+        free_cmds(q->head);  // Only input after BYE
+        q->head = q->tail = NULL;
+        q->bytes = 0;
+        q->finished = 1;
+    } else {
+        q->waiting = 1;
+    }
+    int stalled = q->stalled;
+    pthread_mutex_unlock(&q->lock);
+
+    if (stalled) {
+        player_flush(player);
+        executor_resume(player);
+    }
+    return idle;
+}
@@ -0,0 +1,65 @@
+// Prototypes for the executor module: a work-stealing pool of command
+// workers
+
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct player_info;
+
+// The most command workers allowed
+
+#define EXECUTOR_MAXWORKERS 64
+
+// How much input (in bytes) may wait to be run for one player before its
+// reactor stops reading from it -- four read buffers' worth
+
+#define EXECUTOR_MAXQUEUED (4 * 4096)
+
+// The kinds of work queued for a player, in the order it arrived
+
+#define CMD_TEXT 0       // Complete text lines
+#define CMD_FRAMES 1     // Complete binary frames
+#define CMD_TOOLONG 2    // A text line too long to read (answered with ERR)
+#define CMD_ABORT 3      // A frame too long to read (ends the connection)
+
+typedef struct cmdbuf {
+    struct cmdbuf* next;
+    int kind;
+    size_t len;
+    size_t off;          // Bytes already run
+    char data[];
+} cmdbuf;
+
+// A player's queue of commands. Only one worker runs a player at a time
+// ("scheduled" is set while it is on a worker's deque or being run), so
+// its commands run one after the other, in order.
+
+typedef struct {
+    pthread_mutex_t lock;
+    cmdbuf* head;
+    cmdbuf* tail;
+    size_t bytes;        // Input queued and not yet taken by a worker
+    int worker;          // Whose deque it goes on (-1 until first run)
+    int scheduled;       // On a deque, or being run
+    int stalled;         // Stopped until its output drains
+    int paused;          // Its reactor stopped reading (too much queued)
+    int finished;        // It has left (BYE), so its connection can go
+    int waiting;         // Its reactor is waiting to close it
+} cmdq;
+
+void executor_start(int count, int tick_ms,
+                    void (*wake_fn)(struct player_info* player));
+int executor_workers(void);
+void cmdq_init(cmdq* q);
+void cmdq_destroy(cmdq* q);
+int executor_submit(struct player_info* player, int kind, const char* data,
+                    size_t len);
+void executor_resume(struct player_info* player);
+int executor_paused(struct player_info* player);
+int executor_finished(struct player_info* player);
+int executor_quiesce(struct player_info* player);
+
+#endif  // _EXECUTOR_H
@@ -0,0 +1,125 @@
+// The frame module builds messages in the binary protocol's format.
+
+// The binary protocol carries the same commands as the text protocol,
+// but as length-prefixed frames with numeric opcodes, and names players
+// by their ids (handles) rather than their names, so neither end has to
+// scan for newlines, split words or format and parse numbers. Its
+// messages are built here, straight into an outmsg, so they are queued
+// just like text ones. See the README for the full format.
+
+#include <string.h>
+
+#include "frame.h"
+
+/************************************************************************
+ * frame_new allocates a message holding a frame of type "type" with
+ * "len" bytes of payload, and fills in the header. The caller fills in
+ * the payload, from data + FRAME_HDRSIZE.
+ */
+outmsg* frame_new(int type, size_t len) {
+    outmsg* m = outmsg_new(FRAME_HDRSIZE + len);
+    frame_put_u32(m->data, len);
+    m->data[4] = type;
+    return m;
+}
+
+/************************************************************************
+ * frame_text makes a frame whose payload is just "len" bytes of "text".
+ */
+outmsg* frame_text(int type, const char* text, size_t len) {
+    outmsg* m = frame_new(type, len);
+    memcpy(m->data + FRAME_HDRSIZE, text, len);
+    return m;
+}
+
+/************************************************************************
+ * frame_player makes a frame about a player: its id and name, then
+ * "len" bytes of "text" (which may be empty).
+ */
+outmsg* frame_player(int type, player_info* player, const char* text,
+                     size_t len) {
+    size_t nlen = strlen(player->name);
+    outmsg* m = frame_new(type, 8 + 1 + nlen + len);
+    char* cp = frame_put_u64(m->data + FRAME_HDRSIZE, player->handle);
+    *cp++ = nlen;
+    memcpy(cp, player->name, nlen);
+    memcpy(cp + nlen, text, len);
+    return m;
+}
+
+/************************************************************************
+ * Payload size of the member list of roster "r", and writing it at "cp":
+ * a u32 count, then the id, name length and name of each member.
+ */
+static size_t members_len(roster* r) {
+    int count = (r == NULL) ? 0 : r->count;
+    size_t len = 4;
+    for (int i = 0; i < count; i++)
+        len += 8 + 1 + strlen(r->members[i]->name);
+    return len;
+}
+
+static char* put_members(char* cp, roster* r) {
+    int count = (r == NULL) ? 0 : r->count;
+    cp = frame_put_u32(cp, count);
+    for (int i = 0; i < count; i++) {
+        size_t nlen = strlen(r->members[i]->name);
+        cp = frame_put_u64(cp, r->members[i]->handle);
+        *cp++ = nlen;
+        memcpy(cp, r->members[i]->name, nlen);
+        cp += nlen;
+    }
+    return cp;
+}
+
+/************************************************************************
+ * frame_roster makes the OK answer to LIST: a u32 count, then the id,
+ * name length and name of each player in roster "r" (which may be NULL
+ * for an empty room).
+ */
+outmsg* frame_roster(roster* r) {
+    outmsg* m = frame_new(FRAME_OK, members_len(r));
+    put_members(m->data + FRAME_HDRSIZE, r);
+    return m;
+}
+
+/************************************************************************
+ * frame_roster_since makes the OK answer to a LIST that gives a version:
+ * the u64 version of roster "r", then either FRAME_LIST_ALL and the
+ * members, as frame_roster has them, or (if the log in "r" reaches back
+ * to "since") FRAME_LIST_CHANGES, a u32 count, and for each change its
+ * type (FRAME_JOINED or FRAME_LEFT), the player's id, name length and
+ * name.
+ */
+outmsg* frame_roster_since(roster* r, uint64_t since) {
+    int n = room_changes(r, since);
+    size_t len = 8 + 1;
+    if (n < 0) {
+        len += members_len(r);
+    } else {
+        len += 4;
+        for (int i = r->nlog - n; i < r->nlog; i++)
+            len += 1 + 8 + 1 + strlen(r->log[i].name);
+    }
+
+    outmsg* m = frame_new(FRAME_OK, len);
+    char* cp = frame_put_u64(m->data + FRAME_HDRSIZE,
+                             (r == NULL) ? 0 : r->version);
+    if (n < 0) {
+        *cp++ = FRAME_LIST_ALL;
+        put_members(cp, r);
+        return m;
+    }
+
+    *cp++ = FRAME_LIST_CHANGES;
+    cp = frame_put_u32(cp, n);
+    for (int i = r->nlog - n; i < r->nlog; i++) {
+        size_t nlen = strlen(r->log[i].name);
+        *cp++ = r->log[i].joined ? FRAME_JOINED : FRAME_LEFT;
+        cp = frame_put_u64(cp, r->log[i].handle);
+        *cp++ = nlen;
+        memcpy(cp, r->log[i].name, nlen);
+        cp += nlen;
+    }
+    return m;
+}
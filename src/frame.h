@@ -0,0 +1,84 @@
+// Prototypes for the frame module: the binary protocol's wire format
+
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "outq.h"
+#include "player.h"
+#include "room.h"
+
+// A client that sends this byte first speaks the binary protocol for
+// the rest of the connection. No text command can start with it.
+
+#define FRAME_MAGIC 0xA7
+
+// Every frame, in both directions, is a 4-byte payload length and a
+// 1-byte opcode (requests) or type (responses), then the payload. All
+// numbers are big-endian.
+
+#define FRAME_HDRSIZE 5
+
+// Requests, and their payloads
+
+#define FRAME_OP_LOGIN 1    // Name
+#define FRAME_OP_MOVETO 2   // u32 room id
+#define FRAME_OP_CREATE 3   // (nothing)
+#define FRAME_OP_MSG 4      // u64 recipient's player id, then the message
+#define FRAME_OP_STAT 5     // (nothing)
+#define FRAME_OP_LIST 6     // (nothing), or u64 roster version
+#define FRAME_OP_BYE 7      // (nothing)
+#define FRAME_OP_SAY 8      // The message
+#define FRAME_OP_HISTORY 9  // (nothing)
+
+// Responses and notices, and their payloads. What an OK carries depends
+// on the request it answers (see the README).
+
+#define FRAME_OK 0x80       // Request-specific, often nothing
+#define FRAME_ERR 0x81      // Error message
+#define FRAME_JOINED 0x82   // u64 player id, u8 name length, name
+#define FRAME_LEFT 0x83     // u64 player id, u8 name length, name
+#define FRAME_FROM 0x84     // u64 sender id, u8 name length, name, message
+#define FRAME_SAID 0x85     // u64 sender id, u8 name length, name, message
+
+// What the OK answer to a LIST that gives a version holds, after the
+// room's current version
+
+#define FRAME_LIST_ALL 0        // Every member, as for a plain LIST
+#define FRAME_LIST_CHANGES 1    // Only the joins and leaves since then
+
+/************************************************************************
+ * Big-endian loads and stores.
+ */
+static inline uint32_t frame_get_u32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) |
+           ((uint32_t)u[2] << 8) | u[3];
+}
+
+static inline uint64_t frame_get_u64(const char* p) {
+    return ((uint64_t)frame_get_u32(p) << 32) | frame_get_u32(p + 4);
+}
+
+static inline char* frame_put_u32(char* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static inline char* frame_put_u64(char* p, uint64_t v) {
+    return frame_put_u32(frame_put_u32(p, v >> 32), v);
+}
+
+outmsg* frame_new(int type, size_t len);
+outmsg* frame_text(int type, const char* text, size_t len);
+outmsg* frame_player(int type, player_info* player, const char* text,
+                     size_t len);
+outmsg* frame_roster(roster* r);
+outmsg* frame_roster_since(roster* r, uint64_t since);
+
+#endif  // _FRAME_H
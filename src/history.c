@@ -0,0 +1,471 @@
+// The history module keeps each room's recent chat (what its players
+// SAY), so a player who comes into the room can catch up with HISTORY.
+//
+// A room's history is a pair of fixed-size segments, each an
+// append-only log of messages in a memory-mapped file (or in anonymous
+// memory, if the server wasn't given a directory for them). A message
+// is written once, straight from the broadcast into the mapping, and the
+// kernel writes the pages back in its own time -- nothing ever waits
+// for the disk. When the segment being appended to is full, the older
+// one is emptied and appended to instead, so a room always has between
+// one and two segments' worth of its latest messages.
+//
+// The segments belong to a room slot (see room.c), and each records the
+// id of the room its messages are from. After a restart the permanent
+// rooms' segments are mapped again just as they were left, while the
+// other rooms' are emptied, since those rooms are gone.
+//
+// The permanent rooms' segments are mapped at startup. Any other slot's
+// are mapped by the mapper thread, ahead of time: room.c hands out new
+// slots in order, so the mapper keeps the next HISTORY_MAPAHEAD slots
+// past the newest room mapped, and neither CREATE nor a broadcast ever
+// waits for a file to be opened or mapped. A room whose slot isn't
+// mapped yet (a burst of CREATEs can outrun the mapper) has no history
+// until it is. When a room is reclaimed its segments are emptied but
+// stay mapped, ready for the slot's next room, so the mappings (and
+// files) only ever grow, to two segments for each slot the server has
+// used since it started. Nothing is deleted from the directory; a slot
+// that fails to be mapped is tried again when a room is next created
+// in it.
+//
+// Each slot also remembers where its latest HISTORY_MAXMSGS messages
+// are, so answering HISTORY doesn't mean reading through the segments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame.h"
+#include "history.h"
+#include "metrics.h"
+#include "room.h"
+
+// Marks a segment that has been set up
+
+#define HISTORY_MAGIC 0x41524831
+
+// The start of a segment. The messages follow it.
+
+typedef struct {
+    uint32_t magic;      // HISTORY_MAGIC once set up
+    int32_t room;        // Id of the room the messages are from
+    uint64_t seq;        // Counts the room's segments, from 1
+    uint64_t used;       // Bytes of messages (set after each is written)
+} segment;
+
+#define SEG_SPACE (HISTORY_SEGSIZE - sizeof(segment))
+
+// One message: the sender's id, name and the message, padded to a
+// multiple of 8 bytes
+
+typedef struct {
+    uint64_t handle;
+    uint16_t msglen;
+    uint8_t namelen;
+    uint8_t pad[5];
+    char data[];         // The name, then the message
+} record;
+
+// The segments of one room slot
+
+typedef struct {
+    int ready;                 // Lock set up (under mapper_lock)
+    int failed;                // Couldn't be mapped (under mapper_lock),
+                               // 2 if a room wants it again
+    pthread_mutex_t lock;      // Held while using the segments
+    segment* segs[2];          // NULL until mapped
+    int cur;                   // The one being appended to
+    record* recent[HISTORY_MAXMSGS];  // The latest messages, as a ring
+    int first;                 // Index of the oldest of them
+    int nrecent;               // How many there are
+} history_slot;
+
+static history_slot slots[ROOM_MAXROOMS];
+static const char* seg_dir;    // Where the segment files go, or NULL
+
+// What the mapper thread is asked to do. Slots are set up the first
+// time they are needed, so the ones never used are never touched.
+
+static pthread_mutex_t mapper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mapper_wake = PTHREAD_COND_INITIALIZER;
+static int map_next;           // First slot the mapper hasn't tried
+static int map_limit;          // It should map the slots below this
+static int map_retry;          // True if a failed slot is wanted again
+
+/***************************************************************************
+ * Size of the record holding a message of "msglen" bytes from a player
+ * whose name is "namelen" bytes long.
+ */
+static inline size_t record_size(size_t namelen, size_t msglen) {
+    return (sizeof(record) + namelen + msglen + 7) & ~(size_t)7;
+}
+
+/***************************************************************************
+ * True if segment "seg" holds messages from room "room".
+ */
+static inline int live(segment* seg, int room) {
+    return (seg->magic == HISTORY_MAGIC) && (seg->room == room);
+}
+
+/***************************************************************************
+ * Map segment "n" of room slot "slot", from its file if there is a
+ * directory for them. A segment that wasn't left in a usable state, or
+ * that holds the messages of a room from before a restart (any but the
+ * permanent rooms), is emptied. Returns NULL if it can't be mapped.
+ */
+static segment* map_segment(int slot, int n) {
+    int flags = MAP_SHARED;
+    int fd = -1;
+    if (seg_dir != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/room%d.%d", seg_dir, slot, n);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if ((fd < 0) || (ftruncate(fd, HISTORY_SEGSIZE) < 0)) {
+            perror(path);
+            if (fd >= 0)
+                close(fd);
+            return NULL;
+        }
+    } else {
+        flags |= MAP_ANONYMOUS;
+    }
+
+    void* p = mmap(NULL, HISTORY_SEGSIZE, PROT_READ | PROT_WRITE, flags, fd,
+                   0);
+    if (fd >= 0)
+        close(fd);
+    if (p == MAP_FAILED) {
+        perror("history - mapping segment");
+        return NULL;
+    }
+
+    segment* seg = p;
+    if ((seg->magic != HISTORY_MAGIC) || (seg->used > SEG_SPACE) ||
+        (slot >= ROOM_NPERMANENT))
+        memset(seg, 0, sizeof(segment));
+    return seg;
+}
+
+/***************************************************************************
+ * remember adds message "rec" to the latest ones of slot "s" (the oldest
+ * drops out, if there are already HISTORY_MAXMSGS), and forget drops
+ * those in segment "seg", which is about to be emptied. Being older than
+ * any in the other segment, they are the oldest. The caller holds the
+ * slot's lock.
+ */
+static void remember(history_slot* s, record* rec) {
+    if (s->nrecent == HISTORY_MAXMSGS) {
+        s->recent[s->first] = rec;
+        s->first = (s->first + 1) % HISTORY_MAXMSGS;
+    } else {
+        s->recent[(s->first + s->nrecent++) % HISTORY_MAXMSGS] = rec;
+    }
+}
+
+static void forget(history_slot* s, segment* seg) {
+    char* start = (char*)seg;
+    while ((s->nrecent > 0) && ((char*)s->recent[s->first] >= start) &&
+           ((char*)s->recent[s->first] < start + HISTORY_SEGSIZE)) {
+        s->first = (s->first + 1) % HISTORY_MAXMSGS;
+        s->nrecent--;
+    }
+}
+
+/***************************************************************************
+ * Find the latest messages in the segments of slot "s", just mapped:
+ * those in the segment being appended to, and in the one before it if
+ * it is the same room's. A bad record at the end of a segment (left by
+ * an earlier run) is cut off. The caller holds the slot's lock.
+ */
+static void find_recent(history_slot* s) {
+    segment* cur = s->segs[s->cur];
+    segment* prev = s->segs[s->cur ^ 1];
+    if (cur->magic != HISTORY_MAGIC)
+        return;
+
+    segment* segs[2];
+    int nsegs = 0;
+    if (live(prev, cur->room) && (prev->seq + 1 == cur->seq))
+        segs[nsegs++] = prev;
+    segs[nsegs++] = cur;
+
+    // A segment left by an earlier run might end with a bad record
+    for (int i = 0; i < nsegs; i++) {
+        char* base = (char*)(segs[i] + 1);
+        uint64_t off = 0;
+        while (off + sizeof(record) <= segs[i]->used) {
+            record* rec = (record*)(base + off);
+            size_t size = record_size(rec->namelen, rec->msglen);
+            if ((rec->namelen > PLAYER_MAXNAME) ||
+                (off + size > segs[i]->used))
+                break;
+            remember(s, rec);
+            off += size;
+        }
+        segs[i]->used = off;
+    }
+}
+
+/***************************************************************************
+ * Set up slot "s" if this is the first time it is needed. The caller
+ * holds mapper_lock (or is history_init, before there is a mapper).
+ */
+static void init_slot(history_slot* s) {
+    if (!s->ready) {
+        pthread_mutex_init(&s->lock, NULL);
+        s->ready = 1;
+    }
+}
+
+/***************************************************************************
+ * Map the segments of slot "slot" and give them to it. The files are
+ * opened and mapped without any lock held; the slot's lock is only taken
+ * to hand them over. Returns false if they can't be mapped.
+ */
+static int map_slot(int slot) {
+    segment* a = map_segment(slot, 0);
+    segment* b = (a == NULL) ? NULL : map_segment(slot, 1);
+    if (b == NULL) {
+        if (a != NULL)
+            munmap(a, HISTORY_SEGSIZE);
+        return 0;
+    }
+
+    // Carry on appending to the newer one
+    history_slot* s = &slots[slot];
+    metrics_lock(&s->lock, METRIC_LOCK_HISTORY);
+    s->segs[0] = a;
+    s->segs[1] = b;
+    s->cur = (b->seq > a->seq) ? 1 : 0;
+    find_recent(s);
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+/***************************************************************************
+ * The mapper thread maps the slots it is asked to: those that failed
+ * before and are wanted again first, then new ones up to map_limit.
+ */
+static void* mapper_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&mapper_lock);
+    for (;;) {
+        int slot = -1;
+        if (map_retry) {
+            for (int i = 0; (i < map_next) && (slot < 0); i++) {
+                if (slots[i].failed == 2)
+                    slot = i;
+            }
+            if (slot < 0)
+                map_retry = 0;
+        }
+        if ((slot < 0) && (map_next < map_limit)) {
+            slot = map_next++;
+            init_slot(&slots[slot]);
+        }
+        if (slot < 0) {
+            pthread_cond_wait(&mapper_wake, &mapper_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&mapper_lock);
+        int ok = map_slot(slot);
+        pthread_mutex_lock(&mapper_lock);
+        slots[slot].failed = !ok;
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * history_init sets up the history, with the segment files kept in
+ * directory "dir" (made if it doesn't exist), or in memory only if "dir"
+ * is NULL, and maps the permanent rooms' segments. Returns false if the
+ * directory can't be used. Should be called once at the beginning of
+ * main, when the program starts up.
+ */
+int history_init(const char* dir) {
+    if (dir != NULL) {
+        if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+            perror(dir);
+            return 0;
+        }
+        if (access(dir, R_OK | W_OK | X_OK) < 0) {
+            perror(dir);
+            return 0;
+        }
+    }
+    seg_dir = dir;
+
+    // The permanent rooms are there from the start, so don't wait
+    for (int i = 0; i < ROOM_NPERMANENT; i++) {
+        init_slot(&slots[i]);
+        slots[i].failed = !map_slot(i);
+    }
+    map_next = ROOM_NPERMANENT;
+    map_limit = ROOM_NPERMANENT + HISTORY_MAPAHEAD;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, mapper_thread, NULL) != 0) {
+        fprintf(stderr, "Couldn't start history mapper thread.\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/***************************************************************************
+ * history_prepare gets room slot "slot" ready for a new room, before
+ * anyone can be in it. It never waits for the segments to be mapped:
+ * they normally already are, and if not the mapper thread is asked to
+ * map them (along with the next HISTORY_MAPAHEAD slots).
+ */
+void history_prepare(int slot) {
+    pthread_mutex_lock(&mapper_lock);
+    history_slot* s = &slots[slot];
+    init_slot(s);
+    if (s->failed == 1) {
+        s->failed = 2;
+        map_retry = 1;
+    }
+    int limit = slot + 1 + HISTORY_MAPAHEAD;
+    if (limit > ROOM_MAXROOMS)
+        limit = ROOM_MAXROOMS;
+    if (limit > map_limit)
+        map_limit = limit;
+    if (map_retry || (map_next < map_limit))
+        pthread_cond_signal(&mapper_wake);
+    pthread_mutex_unlock(&mapper_lock);
+}
+
+/***************************************************************************
+ * history_forget empties the segments of room slot "slot", whose room
+ * has just been reclaimed. They stay mapped for the slot's next room.
+ */
+void history_forget(int slot) {
+    history_slot* s = &slots[slot];
+    metrics_lock(&s->lock, METRIC_LOCK_HISTORY);
+    if (s->segs[0] != NULL) {
+        s->segs[0]->magic = 0;
+        s->segs[1]->magic = 0;
+    }
+    s->first = 0;
+    s->nrecent = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/***************************************************************************
+ * history_append adds a message ("msglen" bytes of "msg") that "player"
+ * said to the history of room "room".
+ */
+void history_append(int room, player_info* player, const char* msg,
+                    int msglen) {
+    size_t namelen = strlen(player->name);
+    size_t size = record_size(namelen, msglen);
+    if ((msglen > UINT16_MAX) || (size > SEG_SPACE))
+        return;
+
+    history_slot* s = &slots[room_slot_of(room)];
+    metrics_lock(&s->lock, METRIC_LOCK_HISTORY);
+    if (s->segs[0] == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    // Start a new segment if this one is full (or from another room)
+    segment* seg = s->segs[s->cur];
+    if (!live(seg, room) || (seg->used + size > SEG_SPACE)) {
+        uint64_t seq = 1;
+        if (live(seg, room)) {
+            seq = seg->seq + 1;
+            s->cur ^= 1;
+            seg = s->segs[s->cur];
+            forget(s, seg);
+        } else {
+            s->nrecent = 0;
+        }
+        seg->magic = 0;
+        seg->room = room;
+        seg->seq = seq;
+        seg->used = 0;
+        seg->magic = HISTORY_MAGIC;
+    }
+
+    record* rec = (record*)((char*)(seg + 1) + seg->used);
+    rec->handle = player->handle;
+    rec->msglen = msglen;
+    rec->namelen = namelen;
+    memcpy(rec->data, player->name, namelen);
+    memcpy(rec->data + namelen, msg, msglen);
+    seg->used += size;
+    remember(s, rec);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/***************************************************************************
+ * history_recent makes the answer to HISTORY: the latest messages said
+ * in room "room" (up to HISTORY_MAXMSGS), oldest first. For a text
+ * player ("binary" false) it is "OK" and the number of messages, then
+ * a line for each, "(name) says: (message)". For a binary one it is an
+ * OK frame with a u32 count, then for each message the sender's id, name
+ * length and name, and a u32 length and the message.
+ */
+outmsg* history_recent(int room, int binary) {
+    history_slot* s = &slots[room_slot_of(room)];
+    metrics_lock(&s->lock, METRIC_LOCK_HISTORY);
+    int count = 0;
+    if ((s->segs[0] != NULL) && live(s->segs[s->cur], room))
+        count = s->nrecent;
+
+    // Work out the length first, so the answer is built in one allocation
+    char head[32];
+    int headlen = 0;
+    if (!binary)
+        headlen = snprintf(head, sizeof(head), "OK %d\n", count);
+    size_t len = binary ? 4 : headlen;
+    for (int i = 0; i < count; i++) {
+        record* rec = s->recent[(s->first + i) % HISTORY_MAXMSGS];
+        if (binary)
+            len += 8 + 1 + rec->namelen + 4 + rec->msglen;
+        else
+            len += rec->namelen + 7 + rec->msglen + 1;
+    }
+
+    outmsg* m;
+    char* cp;
+    if (binary) {
+        m = frame_new(FRAME_OK, len);
+        cp = frame_put_u32(m->data + FRAME_HDRSIZE, count);
+    } else {
+        m = outmsg_new(len);
+        memcpy(m->data, head, headlen);
+        cp = m->data + headlen;
+    }
+    for (int i = 0; i < count; i++) {
+        record* rec = s->recent[(s->first + i) % HISTORY_MAXMSGS];
+        if (binary) {
+            cp = frame_put_u64(cp, rec->handle);
+            *cp++ = rec->namelen;
+            memcpy(cp, rec->data, rec->namelen);
+            cp = frame_put_u32(cp + rec->namelen, rec->msglen);
+            memcpy(cp, rec->data + rec->namelen, rec->msglen);
+            cp += rec->msglen;
+        } else {
+            memcpy(cp, rec->data, rec->namelen);
+            cp += rec->namelen;
+            memcpy(cp, " says: ", 7);
+            cp += 7;
+            memcpy(cp, rec->data + rec->namelen, rec->msglen);
+            cp += rec->msglen;
+            *cp++ = '\n';
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return m;
+}
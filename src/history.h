@@ -0,0 +1,31 @@
+// Prototypes for the history module: each room's recent chat, kept in
+// memory-mapped segment files
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include "outq.h"
+#include "player.h"
+
+// The most messages a HISTORY answer holds
+
+#define HISTORY_MAXMSGS 20
+
+// Each room's history is kept in two segments of this size (in bytes):
+// the one being appended to, and the one before it
+
+#define HISTORY_SEGSIZE (32 * 1024)
+
+// How many room slots past the newest room the mapper thread keeps
+// mapped, so that CREATE finds the new room's segments ready
+
+#define HISTORY_MAPAHEAD 16
+
+int history_init(const char* dir);
+void history_prepare(int slot);
+void history_forget(int slot);
+void history_append(int room, player_info* player, const char* msg,
+                    int msglen);
+outmsg* history_recent(int room, int binary);
+
+#endif  // _HISTORY_H
@@ -0,0 +1,384 @@
+// The metrics module counts what the server is doing, cheaply enough to
+// leave on all the time.
+
+// Every thread gets its own block of counters and histograms the first
+// time it records anything, so recording is a load and a store to memory
+// no other thread writes -- no locks, no atomic read-modify-write, no
+// cache lines bouncing between cores. Reading the metrics adds up every
+// thread's block; a reader may see one thread's update a moment late,
+// but never a torn value.
+//
+// Histograms use HDR-style buckets: exact below 8, and above that eight
+// buckets per power of two, so every bucket is within 12.5% of the
+// values in it from nanoseconds up to hours, in a fixed ~500 buckets.
+//
+// metrics_render formats everything in the Prometheus text exposition
+// format, for the admin port (see admin.c).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "room.h"
+#include "trace.h"
+#include "metrics.h"
+
+static __thread metrics_thread* self;
+
+// Every thread's block, newest first. Blocks are never freed.
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread* threads;
+static int nthreads;
+
+// Names used in the exposition format
+
+static const char* verb_names[METRIC_NVERBS] = {
+    "LOGIN", "MOVETO", "CREATE", "MSG", "STAT", "LIST", "BYE", "SAY",
+    "HISTORY", "unknown"
+};
+
+static const char* lock_names[METRIC_NLOCKS] = {
+    "player_shard", "name_shard", "room", "room_pool", "outq",
+    "history"
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_info[METRIC_NCOUNTERS] = {
+    { "arena_connections_total", "Connections accepted." },
+    { "arena_disconnections_total", "Connections closed." },
+    { "arena_received_bytes_total", "Bytes read from clients." },
+    { "arena_sent_bytes_total", "Bytes written to clients." },
+    { "arena_reads_total", "Reads that returned data." },
+    { "arena_writes_total", "Write system calls." },
+    { "arena_messages_queued_total", "Messages queued for players." },
+    { "arena_messages_dropped_total", "Messages dropped from full queues." },
+    { "arena_slow_consumers_disconnected_total",
+      "Players disconnected because their queue was full." },
+    { "arena_migrations_total",
+      "Players handed over to the reactor that owns their room." },
+    { "arena_steals_total",
+      "Players a command worker took from another worker's deque." },
+};
+
+/************************************************************************
+ * metrics_verb_name and metrics_lock_name return the names used for a
+ * command verb id and a lock id.
+ */
+const char* metrics_verb_name(int verb) {
+    return verb_names[verb];
+}
+
+const char* metrics_lock_name(int which) {
+    return lock_names[which];
+}
+
+/************************************************************************
+ * metrics_self returns the calling thread's metrics, creating them the
+ * first time.
+ */
+metrics_thread* metrics_self(void) {
+    if (self != NULL)
+        return self;
+
+    metrics_thread* t = calloc(1, sizeof(metrics_thread));
+    if (t == NULL) {
+        perror("metrics_self");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&threads_lock);
+    t->id = nthreads++;
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threads_lock);
+
+    self = t;
+    return t;
+}
+
+/************************************************************************
+ * Add "n" to a value only the calling thread writes.
+ */
+static inline void bump(atomic_ulong* v, unsigned long n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/************************************************************************
+ * metrics_count adds "n" to one of the calling thread's counters.
+ */
+void metrics_count(int counter, unsigned long n) {
+    bump(&metrics_self()->counters[counter], n);
+}
+
+/************************************************************************
+ * metrics_total adds up one counter over every thread.
+ */
+unsigned long metrics_total(int counter) {
+    unsigned long total = 0;
+    pthread_mutex_lock(&threads_lock);
+    for (metrics_thread* t = threads; t != NULL; t = t->next)
+        total += atomic_load_explicit(&t->counters[counter],
+                                      memory_order_relaxed);
+    pthread_mutex_unlock(&threads_lock);
+    return total;
+}
+
+/************************************************************************
+ * Which bucket "value" goes in.
+ */
+static int bucket_of(unsigned long value) {
+    if (value < METRIC_SUB)
+        return value;
+    int e = 63 - __builtin_clzl(value);
+    return (e - METRIC_SUBBITS + 1) * METRIC_SUB +
+           ((value >> (e - METRIC_SUBBITS)) & (METRIC_SUB - 1));
+}
+
+/************************************************************************
+ * The smallest value too big for bucket "idx".
+ */
+static unsigned long bucket_limit(int idx) {
+    if (idx < METRIC_SUB)
+        return idx + 1;
+    if (idx == METRIC_NBUCKETS - 1)
+        return ULONG_MAX;
+    int e = idx / METRIC_SUB + METRIC_SUBBITS - 1;
+    unsigned long sub = idx % METRIC_SUB;
+    return (METRIC_SUB + sub + 1) << (e - METRIC_SUBBITS);
+}
+
+/************************************************************************
+ * metrics_observe records one value in one of the calling thread's
+ * histograms.
+ */
+void metrics_observe(int hist, unsigned long value) {
+    metrics_thread* t = metrics_self();
+    bump(&t->hist[hist][bucket_of(value)], 1);
+    bump(&t->hist_sum[hist], value);
+}
+
+/************************************************************************
+ * metrics_lock locks a mutex, and if it was busy, counts the wait (and
+ * how long it took) against lock class "which". Taking a free lock costs
+ * no more than pthread_mutex_trylock.
+ */
+void metrics_lock(pthread_mutex_t* lock, int which) {
+    if (pthread_mutex_trylock(lock) == 0)
+        return;
+
+    unsigned long start = metrics_now();
+    TRACE_START(trace_start);
+    pthread_mutex_lock(lock);
+    TRACE_END(trace_start, TRACE_LOCK_WAIT, which);
+    metrics_thread* t = metrics_self();
+    bump(&t->lock_waits[which], 1);
+    bump(&t->lock_wait_ns[which], metrics_now() - start);
+}
+
+// A growing buffer for building the exposition text
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} textbuf;
+
+/************************************************************************
+ * Append printf-style output to a text buffer.
+ */
+static void append(textbuf* b, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(textbuf* b, const char* fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if ((n >= 0) && ((size_t)n < b->cap - b->len)) {
+            b->len += n;
+            return;
+        }
+
+        b->cap = (b->cap == 0) ? 16384 : 2 * b->cap;
+        if ((b->data = realloc(b->data, b->cap)) == NULL) {
+            perror("metrics - building text");
+            exit(1);
+        }
+    }
+}
+
+/************************************************************************
+ * Add up histogram "hist" over every thread. Caller holds threads_lock.
+ */
+static void merge(int hist, unsigned long* buckets, unsigned long* sum,
+                  unsigned long* count) {
+    memset(buckets, 0, METRIC_NBUCKETS * sizeof(unsigned long));
+    *sum = 0;
+    *count = 0;
+    for (metrics_thread* t = threads; t != NULL; t = t->next) {
+        for (int i = 0; i < METRIC_NBUCKETS; i++) {
+            unsigned long n = atomic_load_explicit(&t->hist[hist][i],
+                                                   memory_order_relaxed);
+            buckets[i] += n;
+            *count += n;
+        }
+        *sum += atomic_load_explicit(&t->hist_sum[hist], memory_order_relaxed);
+    }
+}
+
+/************************************************************************
+ * The value below which fraction "q" of a merged histogram falls (the
+ * top of the bucket it lands in).
+ */
+static unsigned long quantile(unsigned long* buckets, unsigned long count,
+                              double q) {
+    if (count == 0)
+        return 0;
+    unsigned long want = (unsigned long)(q * count);
+    if (want == 0)
+        want = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < METRIC_NBUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= want)
+            return bucket_limit(i) - 1;
+    }
+    return ULONG_MAX;
+}
+
+/************************************************************************
+ * Write out a merged histogram with its buckets at powers of two from
+ * 2^lo to 2^hi, in "scale" units per unit of the raw values. Up to 2^3
+ * the buckets are exact; above that, a value of exactly 2^k is counted
+ * in the next bucket up (a 1-in-2^k error).
+ */
+static void render_hist(textbuf* b, const char* name, const char* labels,
+                        unsigned long* buckets, unsigned long sum,
+                        unsigned long count, int lo, int hi, double scale) {
+    const char* sep = (labels[0] != '\0') ? "," : "";
+    unsigned long cum = 0;
+    int idx = 0;
+    for (int k = lo; k <= hi; k++) {
+        int limit = bucket_of(1UL << k) + (k <= METRIC_SUBBITS);
+        for (; idx < limit; idx++)
+            cum += buckets[idx];
+        append(b, "%s_bucket{%s%sle=\"%.10g\"} %lu\n", name, labels, sep,
+               (double)(1UL << k) * scale, cum);
+    }
+    append(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, count);
+    if (labels[0] != '\0') {
+        append(b, "%s_sum{%s} %.9g\n", name, labels, sum * scale);
+        append(b, "%s_count{%s} %lu\n", name, labels, count);
+    } else {
+        append(b, "%s_sum %.9g\n", name, sum * scale);
+        append(b, "%s_count %lu\n", name, count);
+    }
+}
+
+/************************************************************************
+ * Write one line per room with players in it (and the permanent rooms).
+ */
+static void render_room(int id, int count, void* arg) {
+    append((textbuf*)arg, "arena_room_players{room=\"%d\"} %d\n", id, count);
+}
+
+/************************************************************************
+ * metrics_render returns every metric in the Prometheus text format, as
+ * a newly allocated string (which the caller must free) of "*len"
+ * bytes. The room populations come from RCU-protected rosters, so the
+ * caller must be a registered RCU thread.
+ */
+char* metrics_render(size_t* len) {
+    textbuf b = { NULL, 0, 0 };
+    static unsigned long buckets[METRIC_NBUCKETS];
+    static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&render_lock);
+    pthread_mutex_lock(&threads_lock);
+
+    // Counters, per thread
+    for (int c = 0; c < METRIC_NCOUNTERS; c++) {
+        append(&b, "# HELP %s %s\n# TYPE %s counter\n", counter_info[c].name,
+               counter_info[c].help, counter_info[c].name);
+        for (metrics_thread* t = threads; t != NULL; t = t->next)
+            append(&b, "%s{thread=\"%d\"} %lu\n", counter_info[c].name, t->id,
+                   atomic_load_explicit(&t->counters[c], memory_order_relaxed));
+    }
+
+    // Lock waits, per lock class
+    append(&b, "# HELP arena_lock_contended_total Times a lock was busy.\n"
+           "# TYPE arena_lock_contended_total counter\n");
+    for (int l = 0; l < METRIC_NLOCKS; l++) {
+        unsigned long n = 0;
+        for (metrics_thread* t = threads; t != NULL; t = t->next)
+            n += atomic_load_explicit(&t->lock_waits[l], memory_order_relaxed);
+        append(&b, "arena_lock_contended_total{lock=\"%s\"} %lu\n",
+               lock_names[l], n);
+    }
+    append(&b, "# HELP arena_lock_wait_seconds_total Time spent waiting "
+           "for busy locks.\n# TYPE arena_lock_wait_seconds_total counter\n");
+    for (int l = 0; l < METRIC_NLOCKS; l++) {
+        unsigned long ns = 0;
+        for (metrics_thread* t = threads; t != NULL; t = t->next)
+            ns += atomic_load_explicit(&t->lock_wait_ns[l], memory_order_relaxed);
+        append(&b, "arena_lock_wait_seconds_total{lock=\"%s\"} %.9g\n",
+               lock_names[l], ns / 1e9);
+    }
+
+    // Command latency, per verb, with quantiles worked out here
+    unsigned long sum, count;
+    append(&b, "# HELP arena_command_seconds Time to run a command.\n"
+           "# TYPE arena_command_seconds histogram\n");
+    for (int v = 0; v < METRIC_NVERBS; v++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "verb=\"%s\"", verb_names[v]);
+        merge(v, buckets, &sum, &count);
+        render_hist(&b, "arena_command_seconds", labels, buckets, sum, count,
+                    8, 34, 1e-9);
+    }
+    append(&b, "# HELP arena_command_quantile_seconds Command time "
+           "quantiles (within 12.5%%).\n"
+           "# TYPE arena_command_quantile_seconds gauge\n");
+    for (int v = 0; v < METRIC_NVERBS; v++) {
+        merge(v, buckets, &sum, &count);
+        double qs[] = { 0.5, 0.99, 0.999 };
+        for (int i = 0; i < 3; i++)
+            append(&b, "arena_command_quantile_seconds{verb=\"%s\","
+                   "quantile=\"%g\"} %.9g\n", verb_names[v], qs[i],
+                   quantile(buckets, count, qs[i]) / 1e9);
+    }
+
+    // Queue depths
+    append(&b, "# HELP arena_outq_depth Messages in a player's queue once "
+           "a new one is added.\n# TYPE arena_outq_depth histogram\n");
+    merge(METRIC_HIST_QDEPTH, buckets, &sum, &count);
+    render_hist(&b, "arena_outq_depth", "", buckets, sum, count, 0, 16, 1.0);
+
+    // Players
+    unsigned long connects = 0, disconnects = 0;
+    for (metrics_thread* t = threads; t != NULL; t = t->next) {
+        connects += atomic_load(&t->counters[METRIC_CONNECTS]);
+        disconnects += atomic_load(&t->counters[METRIC_DISCONNECTS]);
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    append(&b, "# HELP arena_players_connected Open connections.\n"
+           "# TYPE arena_players_connected gauge\n"
+           "arena_players_connected %ld\n", (long)(connects - disconnects));
+    append(&b, "# HELP arena_rooms Rooms that exist.\n"
+           "# TYPE arena_rooms gauge\narena_rooms %d\n", room_count());
+    append(&b, "# HELP arena_room_players Registered players in each room.\n"
+           "# TYPE arena_room_players gauge\n");
+    room_foreach(render_room, &b);
+    pthread_mutex_unlock(&render_lock);
+
+    *len = b.len;
+    return b.data;
+}
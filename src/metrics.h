@@ -0,0 +1,95 @@
+// Prototypes for the metrics module: per-thread counters and histograms
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Counters, kept per thread
+
+#define METRIC_CONNECTS 0         // Connections accepted
+#define METRIC_DISCONNECTS 1      // Connections closed
+#define METRIC_BYTES_IN 2         // Bytes read from clients
+#define METRIC_BYTES_OUT 3        // Bytes written to clients
+#define METRIC_READS 4            // recv() calls that returned data
+#define METRIC_WRITES 5           // sendmsg() calls
+#define METRIC_ENQUEUED 6         // Messages queued for players
+#define METRIC_DROPPED 7          // Messages dropped from full queues
+#define METRIC_SLOW_DISCONNECTS 8 // Players disconnected for a full queue
+#define METRIC_MIGRATIONS 9       // Players handed to another reactor
+#define METRIC_STEALS 10          // Players a command worker stole
+#define METRIC_NCOUNTERS 11
+
+// Histograms. Each command verb has a latency histogram (nanoseconds),
+// and there is one of the queue depth seen by each new message.
+
+#define METRIC_VERB_LOGIN 0
+#define METRIC_VERB_MOVETO 1
+#define METRIC_VERB_CREATE 2
+#define METRIC_VERB_MSG 3
+#define METRIC_VERB_STAT 4
+#define METRIC_VERB_LIST 5
+#define METRIC_VERB_BYE 6
+#define METRIC_VERB_SAY 7
+#define METRIC_VERB_HISTORY 8
+#define METRIC_VERB_UNKNOWN 9
+#define METRIC_NVERBS 10
+
+#define METRIC_HIST_QDEPTH METRIC_NVERBS
+#define METRIC_NHISTS (METRIC_NVERBS + 1)
+
+// Histogram buckets are HDR-style: values below 2^METRIC_SUBBITS have a
+// bucket each, and above that every power of two is split into
+// 2^METRIC_SUBBITS buckets, so a bucket is never more than 1/8 (12.5%)
+// wider than its lower bound, whatever the scale.
+
+#define METRIC_SUBBITS 3
+#define METRIC_SUB (1 << METRIC_SUBBITS)
+#define METRIC_NBUCKETS ((64 - METRIC_SUBBITS + 1) * METRIC_SUB)
+
+// Locks whose waits are timed
+
+#define METRIC_LOCK_PLAYER_SHARD 0
+#define METRIC_LOCK_NAME_SHARD 1
+#define METRIC_LOCK_ROOM 2
+#define METRIC_LOCK_ROOM_POOL 3
+#define METRIC_LOCK_OUTQ 4
+#define METRIC_LOCK_HISTORY 5
+#define METRIC_NLOCKS 6
+
+// One thread's metrics. Only the owning thread writes them, so updates
+// are plain loads and stores (atomic only so that readers see whole
+// values), and nothing is shared between threads until it is read.
+
+typedef struct metrics_thread {
+    struct metrics_thread* next;   // Next thread's metrics
+    int id;                        // Thread number, in order of first use
+    atomic_ulong counters[METRIC_NCOUNTERS];
+    atomic_ulong lock_waits[METRIC_NLOCKS];     // Times a lock was busy
+    atomic_ulong lock_wait_ns[METRIC_NLOCKS];   // Time spent waiting
+    atomic_ulong hist_sum[METRIC_NHISTS];
+    atomic_ulong hist[METRIC_NHISTS][METRIC_NBUCKETS];
+} metrics_thread;
+
+metrics_thread* metrics_self(void);
+void metrics_count(int counter, unsigned long n);
+unsigned long metrics_total(int counter);
+void metrics_observe(int hist, unsigned long value);
+void metrics_lock(pthread_mutex_t* lock, int which);
+char* metrics_render(size_t* len);
+const char* metrics_verb_name(int verb);
+const char* metrics_lock_name(int which);
+
+/************************************************************************
+ * metrics_now returns the monotonic clock in nanoseconds, for timing.
+ */
+static inline unsigned long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif  // _METRICS_H
@@ -0,0 +1,339 @@
+// Microbenchmarks for the server's hot paths.
+
+// Each benchmark runs one operation in a loop, in process and without
+// any network, and reports how long it takes (ns/op) and how many
+// memory allocations it makes (allocs/op). Together these are the floor
+// under the cost of every command. Run them with "make bench".
+//
+// Allocations are counted by wrapping malloc and friends at link time
+// (see microbench_LDFLAGS in the Makefile), so only calls made from our
+// own code are counted -- not ones made inside the C library.
+//
+// Players used here have no connection. They are corked, so anything
+// sent to them just sits in their queue (which is kept small, and runs
+// full, so each new message also frees the oldest one) -- the numbers
+// include building and queueing responses, but not writing them out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "alist.h"
+#include "outq.h"
+#include "player.h"
+#include "nametab.h"
+#include "pllist.h"
+#include "rcu.h"
+#include "room.h"
+#include "arena_protocol.h"
+#include "frame.h"
+#include "history.h"
+
+// Queue size for the benchmark players
+
+#define BENCH_QUEUE 16
+
+// Allocation counting
+
+static unsigned long nallocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+void* __real_aligned_alloc(size_t align, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    nallocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    nallocs++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    nallocs++;
+    return __real_realloc(p, size);
+}
+
+void* __wrap_aligned_alloc(size_t align, size_t size) {
+    nallocs++;
+    return __real_aligned_alloc(align, size);
+}
+
+/************************************************************************
+ * Current time in nanoseconds, from the monotonic clock.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/************************************************************************
+ * Run "fn" for "iters" iterations (after a short warm-up) and print the
+ * time and allocations per iteration.
+ */
+static void run(const char* name, void (*fn)(long iters), long iters) {
+    fn(iters / 10 + 1);
+
+    unsigned long before = nallocs;
+    long long start = now_ns();
+    fn(iters);
+    long long elapsed = now_ns() - start;
+    unsigned long allocs = nallocs - before;
+
+    printf("%-40s %10.1f ns/op %10.2f allocs/op\n", name,
+           (double)elapsed / iters, (double)allocs / iters);
+}
+
+// Fixtures shared by the benchmarks below
+
+static alist list;
+static player_info** fakes;   // Players that are only names
+static int nfakes;
+static nametab names;
+static player_info* sender;   // A registered player to run commands as
+static unsigned int seed = 1;
+
+/************************************************************************
+ * A small, fast random number generator, so the benchmarks don't end up
+ * measuring rand().
+ */
+static unsigned int next_rand(void) {
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+/************************************************************************
+ * Destructor for list entries that own nothing.
+ */
+static void no_free(void* p) {
+}
+
+// alist
+
+static void bench_alist_add(long iters) {
+    alist a;
+    alist_init(&a, no_free);
+    for (long i = 0; i < iters; i++)
+        alist_add(&a, &a);
+    alist_destroy(&a);
+}
+
+static void bench_alist_get(long iters) {
+    int n = alist_size(&list);
+    for (long i = 0; i < iters; i++)
+        alist_get(&list, next_rand() % n);
+}
+
+static void bench_alist_remove_first(long iters) {
+    for (long i = 0; i < iters; i++) {
+        alist_remove(&list, 0);
+        alist_add(&list, &list);
+    }
+}
+
+static void bench_alist_remove_last(long iters) {
+    for (long i = 0; i < iters; i++) {
+        alist_remove(&list, alist_size(&list) - 1);
+        alist_add(&list, &list);
+    }
+}
+
+// Name lookups, which is all that pllist_find_nolock does
+
+static void make_fakes(int n) {
+    nametab_init(&names);
+    nfakes = n;
+    if ((fakes = calloc(n, sizeof(player_info*))) == NULL) {
+        perror("microbench - allocating players");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        if ((fakes[i] = calloc(1, sizeof(player_info))) == NULL) {
+            perror("microbench - allocating players");
+            exit(1);
+        }
+        snprintf(fakes[i]->name, sizeof(fakes[i]->name), "player%d", i);
+        nametab_insert(&names, fakes[i]->name, fakes[i]);
+    }
+    rcu_quiescent();
+}
+
+static void free_fakes(void) {
+    for (int i = 0; i < nfakes; i++)
+        free(fakes[i]);
+    free(fakes);
+    nametab_destroy(&names);
+}
+
+static void bench_find_hit(long iters) {
+    for (long i = 0; i < iters; i++)
+        nametab_find(&names, fakes[next_rand() % nfakes]->name);
+}
+
+static void bench_find_miss(long iters) {
+    for (long i = 0; i < iters; i++)
+        nametab_find(&names, "nobody");
+}
+
+// Room broadcasts, to a room of "room_size" corked players
+
+static void bench_announce(long iters) {
+    for (long i = 0; i < iters; i++) {
+        pllist_announce_arrival(sender);
+        if ((i & 1023) == 0)
+            rcu_quiescent();
+    }
+}
+
+// Parsing and running commands
+
+static void bench_trim(long iters) {
+    char line[64];
+    for (long i = 0; i < iters; i++) {
+        strcpy(line, "   MSG alice some message here   \r\n");
+        trim(line);
+    }
+}
+
+static const char* command_line;
+
+static void bench_docommand(long iters) {
+    size_t len = strlen(command_line);
+    for (long i = 0; i < iters; i++) {
+        docommand(sender, command_line, len);
+        if ((i & 1023) == 0)
+            rcu_quiescent();
+    }
+}
+
+static player_info* bin_sender;  // The same, speaking the binary protocol
+static int frame_op;
+static char frame_payload[64];
+static size_t frame_len;
+
+static void bench_doframe(long iters) {
+    for (long i = 0; i < iters; i++) {
+        doframe(bin_sender, frame_op, frame_payload, frame_len);
+        if ((i & 1023) == 0)
+            rcu_quiescent();
+    }
+}
+
+/************************************************************************
+ * Make a registered, corked player named "name" (with no connection).
+ */
+static player_info* make_player(const char* name) {
+    player_info* p = new_player(-1);
+    pllist_add(p);
+    player_cork(p);
+    if (!pllist_addifnew(p, (char*)name)) {
+        fprintf(stderr, "microbench: couldn't register %s\n", name);
+        exit(1);
+    }
+    p->state = PLAYER_REG;
+    return p;
+}
+
+/************************************************************************
+ * Run every benchmark.
+ */
+int main(int argc, char* argv[]) {
+    outq_configure(BENCH_QUEUE, OUTQ_DROP_OLDEST);
+    player_pool_init();
+    protocol_init();
+    history_init(NULL);
+    pllist_init();
+    rcu_register_thread();
+
+    printf("alist\n");
+    run("alist_add", bench_alist_add, 10000000);
+    alist_init(&list, no_free);
+    for (int i = 0; i < 1000; i++)
+        alist_add(&list, &list);
+    run("alist_get (1k)", bench_alist_get, 10000000);
+    run("alist_remove first (1k)", bench_alist_remove_first, 200000);
+    run("alist_remove last (1k)", bench_alist_remove_last, 10000000);
+    alist_destroy(&list);
+
+    printf("\nname lookup\n");
+    int sizes[] = { 10, 1000, 100000 };
+    for (int i = 0; i < 3; i++) {
+        char label[64];
+        make_fakes(sizes[i]);
+        snprintf(label, sizeof(label), "find hit (%d players)", sizes[i]);
+        run(label, bench_find_hit, 2000000);
+        snprintf(label, sizeof(label), "find miss (%d players)", sizes[i]);
+        run(label, bench_find_miss, 2000000);
+        free_fakes();
+        rcu_quiescent();
+    }
+
+    printf("\nroom broadcast\n");
+    sender = make_player("sender");
+    int count = 1;
+    int room_sizes[] = { 10, 100, 1000 };
+    for (int i = 0; i < 3; i++) {
+        char label[64];
+        for (; count < room_sizes[i]; count++) {
+            char name[PLAYER_MAXNAME+1];
+            snprintf(name, sizeof(name), "member%d", count);
+            make_player(name);
+            rcu_quiescent();
+        }
+        snprintf(label, sizeof(label), "announce (%d in room)", room_sizes[i]);
+        run(label, bench_announce, 2000000 / room_sizes[i]);
+    }
+
+    // Commands run in a room of their own, so LIST has a short answer
+    pllist_moveto(sender, 1);
+
+    printf("\nparsing and commands\n");
+    run("trim", bench_trim, 10000000);
+    const char* commands[] = {
+        "STAT", "LIST", "MSG member1 hello there", "MSG nobody hello there",
+        "  MSG member1   hello there  ", "SAY hello there", "HISTORY", "FOO bar baz",
+        "MOVETO arena1"
+    };
+    for (int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        char label[64];
+        command_line = commands[i];
+        snprintf(label, sizeof(label), "docommand \"%s\"", commands[i]);
+        run(label, bench_docommand, 1000000);
+    }
+
+    // A LIST that gives the room's current version has no changes to list
+    char list_since[64];
+    snprintf(list_since, sizeof(list_since), "LIST %lu",
+             (unsigned long)room_snapshot(sender->in_room)->version);
+    command_line = list_since;
+    run("docommand \"LIST <version>\"", bench_docommand, 1000000);
+
+    // The same commands in the binary protocol, from a player in the same
+    // room (so LIST has one more name in it)
+    bin_sender = make_player("binsender");
+    bin_sender->proto = PLAYER_BINARY;
+    pllist_moveto(bin_sender, 1);
+    player_info* member1 = pllist_link("member1");
+
+    frame_op = FRAME_OP_STAT;
+    run("doframe STAT", bench_doframe, 1000000);
+    frame_op = FRAME_OP_LIST;
+    run("doframe LIST", bench_doframe, 1000000);
+    frame_op = FRAME_OP_MSG;
+    frame_put_u64(frame_payload, member1->handle);
+    memcpy(frame_payload + 8, "hello there", 11);
+    frame_len = 8 + 11;
+    run("doframe MSG (to an id)", bench_doframe, 1000000);
+    frame_op = FRAME_OP_MOVETO;
+    frame_put_u32(frame_payload, 1);
+    frame_len = 4;
+    run("doframe MOVETO", bench_doframe, 1000000);
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+// A hash table mapping player names to player_info structs.
+
+// This uses open addressing with linear probing, and keeps a copy of
+// each name in the slot itself (names are at most PLAYER_MAXNAME
+// characters), so finding a name is usually a single hash and one or
+// two string compares no matter how many players there are. Deleted
+// entries leave a "tombstone" behind so probe chains are not broken;
+// the table is rebuilt when live entries plus tombstones get too dense.
+//
+// Lookups take no locks at all: they can run alongside one writer
+// (the caller, pllist, serializes writers with its own lock). A writer
+// fills in the inline name before publishing the player pointer, and
+// deletes by swapping in a tombstone, so a reader only ever sees whole
+// entries -- except when a tombstone is being reused, which is why a
+// match on the inline name is confirmed against the player's own name.
+// Growing the table builds a new slot array and publishes it with one
+// pointer store; the old array is freed after an RCU grace period.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rcu.h"
+#include "nametab.h"
+
+// Marks a deleted slot. Never dereferenced.
+
+static char tombstone_marker;
+#define TOMBSTONE ((player_info*)&tombstone_marker)
+
+/***************************************************************************
+ * nametab_hash computes the 32-bit FNV-1a hash of a name. Tables use the
+ * low bits, so callers splitting names between tables use the high ones.
+ */
+unsigned int nametab_hash(const char* name) {
+    unsigned int h = 2166136261u;
+    while (*name != '\0') {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/***************************************************************************
+ * alloc_slots allocates an array of "capacity" empty slots.
+ */
+static nametab_slots* alloc_slots(int capacity) {
+    nametab_slots* tab = calloc(1, sizeof(nametab_slots) +
+                                   capacity * sizeof(nametab_entry));
+    if (tab == NULL) {
+        perror("nametab - allocating slots");
+        exit(1);
+    }
+    tab->capacity = capacity;
+    return tab;
+}
+
+/***************************************************************************
+ * nametab_init initializes an empty table with the default capacity.
+ */
+void nametab_init(nametab* t) {
+    atomic_init(&t->table, alloc_slots(NAMETAB_DEF_CAPACITY));
+    t->in_use = 0;
+    t->tombstones = 0;
+}
+
+/***************************************************************************
+ * rehash rebuilds the table with "capacity" slots, dropping tombstones.
+ * The new array is private until it is published, so it can be filled
+ * without any care for readers.
+ */
+static void rehash(nametab* t, int capacity) {
+    nametab_slots* old = atomic_load(&t->table);
+    nametab_slots* tab = alloc_slots(capacity);
+
+    unsigned int mask = capacity - 1;
+    for (int i = 0; i < old->capacity; i++) {
+        player_info* p = atomic_load_explicit(&old->slots[i].player,
+                                              memory_order_relaxed);
+        if ((p != NULL) && (p != TOMBSTONE)) {
+            unsigned int j = nametab_hash(old->slots[i].name) & mask;
+            while (atomic_load_explicit(&tab->slots[j].player,
+                                        memory_order_relaxed) != NULL)
+                j = (j + 1) & mask;
+            strcpy(tab->slots[j].name, old->slots[i].name);
+            atomic_store_explicit(&tab->slots[j].player, p,
+                                  memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&t->table, tab, memory_order_release);
+    t->tombstones = 0;
+    rcu_retire(old, free);
+}
+
+/***************************************************************************
+ * nametab_find returns the player registered under "name", or NULL if
+ * there is none. Lock-free; the result stays valid until the calling
+ * thread's next RCU quiescent state.
+ */
+player_info* nametab_find(nametab* t, const char* name) {
+    nametab_slots* tab = atomic_load_explicit(&t->table, memory_order_acquire);
+    unsigned int mask = tab->capacity - 1;
+    unsigned int i = nametab_hash(name) & mask;
+
+    player_info* p;
+    while ((p = atomic_load_explicit(&tab->slots[i].player,
+                                     memory_order_acquire)) != NULL) {
+        if ((p != TOMBSTONE) &&
+            (strncmp(tab->slots[i].name, name, PLAYER_MAXNAME+1) == 0) &&
+            (strcmp(p->name, name) == 0)) {
+            return p;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/***************************************************************************
+ * nametab_insert adds "name" -> "player" if the name is not already in
+ * the table. Returns true if it was added, false if the name was taken.
+ * This is a single probe sequence, so check-and-insert is one operation.
+ * The player's own name must already be set to "name" (readers check
+ * it), and the caller must hold the writers' lock.
+ */
+int nametab_insert(nametab* t, const char* name, player_info* player) {
+    nametab_slots* tab = atomic_load(&t->table);
+
+    // Keep the load (including tombstones) at most 3/4. If it is mostly
+    // tombstones, just clean up at the same size instead of growing.
+    if (4 * (t->in_use + t->tombstones + 1) > 3 * tab->capacity) {
+        int newcap = tab->capacity;
+        if (2 * (t->in_use + 1) > newcap)
+            newcap = 2 * newcap;
+        rehash(t, newcap);
+        tab = atomic_load(&t->table);
+    }
+
+    unsigned int mask = tab->capacity - 1;
+    unsigned int i = nametab_hash(name) & mask;
+    int reuse = -1;  // First tombstone seen, to reuse for the insert
+
+    player_info* p;
+    while ((p = atomic_load_explicit(&tab->slots[i].player,
+                                     memory_order_relaxed)) != NULL) {
+        if (p == TOMBSTONE) {
+            if (reuse < 0)
+                reuse = i;
+        } else if (strcmp(tab->slots[i].name, name) == 0) {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (reuse >= 0) {
+        i = reuse;
+        t->tombstones--;
+    }
+
+    // Name first, then publish the pointer
+    strcpy(tab->slots[i].name, name);
+    atomic_store_explicit(&tab->slots[i].player, player, memory_order_release);
+    t->in_use++;
+    return 1;
+}
+
+/***************************************************************************
+ * nametab_remove deletes "name" from the table, if present. The caller
+ * must hold the writers' lock.
+ */
+void nametab_remove(nametab* t, const char* name) {
+    nametab_slots* tab = atomic_load(&t->table);
+    unsigned int mask = tab->capacity - 1;
+    unsigned int i = nametab_hash(name) & mask;
+
+    player_info* p;
+    while ((p = atomic_load_explicit(&tab->slots[i].player,
+                                     memory_order_relaxed)) != NULL) {
+        if ((p != TOMBSTONE) && (strcmp(tab->slots[i].name, name) == 0)) {
+            atomic_store_explicit(&tab->slots[i].player, TOMBSTONE,
+                                  memory_order_release);
+            t->in_use--;
+            t->tombstones++;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+/***************************************************************************
+ * nametab_destroy frees the table's memory. The players themselves are
+ * not touched. There must be no readers left.
+ */
+void nametab_destroy(nametab* t) {
+    free(atomic_load(&t->table));
+    atomic_store(&t->table, NULL);
+    t->in_use = 0;
+    t->tombstones = 0;
+}
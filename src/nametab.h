@@ -0,0 +1,47 @@
+// Prototypes for the name table: a hash table from player names to players
+
+#ifndef _NAMETAB_H
+#define _NAMETAB_H
+
+#include <stdatomic.h>
+
+#include "player.h"
+
+#define NAMETAB_DEF_CAPACITY 64
+
+// One slot of the open-addressing table. The key is stored inline, so a
+// probe only touches the slot array (no pointer chasing to compare
+// names). An empty slot has player == NULL. The player pointer is
+// written last, so a reader that sees it also sees the name.
+
+typedef struct {
+    char name[PLAYER_MAXNAME+1];
+    _Atomic(player_info*) player;
+} nametab_entry;
+
+// The slot array is replaced as a whole when the table is resized, so
+// it carries its own capacity.
+
+typedef struct {
+    int capacity;             // How big is the slot array (a power of two)
+    nametab_entry slots[];
+} nametab_slots;
+
+// Lookups are lock-free and may run at the same time as one writer
+// (callers serialize their writers). Replaced slot arrays are freed
+// through rcu_retire, so readers must be registered RCU threads.
+
+typedef struct {
+    _Atomic(nametab_slots*) table;
+    int in_use;      // Slots holding a live entry
+    int tombstones;  // Slots holding a deleted entry
+} nametab;
+
+unsigned int nametab_hash(const char* name);
+void nametab_init(nametab* t);
+player_info* nametab_find(nametab* t, const char* name);
+int nametab_insert(nametab* t, const char* name, player_info* player);
+void nametab_remove(nametab* t, const char* name);
+void nametab_destroy(nametab* t);
+
+#endif  // _NAMETAB_H
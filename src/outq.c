@@ -0,0 +1,436 @@
+// The outq module keeps the messages waiting to be sent to one player.
+
+// Anything sent to a player -- responses, announcements, messages from
+// other players -- goes into that player's bounded queue, and is then
+// written to the socket without ever blocking. If the socket is full,
+// the rest stays queued and is written by the player's reactor when
+// epoll says the socket is writable again. So a slow or stalled client
+// only ever fills up its own queue; whoever is talking to it carries on.
+//
+// When a queue is full, the configured policy decides: either drop the
+// oldest message nobody has started writing yet, or give up on the
+// client and disconnect it.
+//
+// Messages are shared, read-only and reference counted: a room
+// announcement is formatted once and a reference is queued for each
+// member. Queues are written with one gather (sendmsg) call covering
+// as many queued messages as possible, so nothing is ever copied into
+// a per-player buffer.
+//
+// With the io_uring reactor, the player's own reactor can also hand the
+// front of a queue to the kernel as asynchronous sends (outq_claim).
+// Until those complete, the claimed messages stay queued -- the kernel
+// is reading them -- and nobody else writes to the socket, so the
+// stream stays in order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "trace.h"
+#include "outq.h"
+
+// Configuration, set once at startup
+
+static int max_msgs = OUTQ_DEF_MAXMSGS;
+static int overflow_policy = OUTQ_DROP_OLDEST;
+
+/***************************************************************************
+ * outq_configure sets the per-player queue limit and the overflow
+ * policy. Must be called before any queue is initialized.
+ */
+void outq_configure(int maxmsgs, int policy) {
+    max_msgs = maxmsgs;
+    overflow_policy = policy;
+}
+
+/***************************************************************************
+ * outmsg_new allocates a message with room for "len" bytes of data. The
+ * caller owns the one reference.
+ */
+outmsg* outmsg_new(size_t len) {
+    outmsg* m = malloc(sizeof(outmsg) + len);
+    if (m == NULL) {
+        perror("outmsg_new");
+        exit(1);
+    }
+    atomic_init(&m->refs, 1);
+    m->len = len;
+    return m;
+}
+
+/***************************************************************************
+ * outmsg_vformat builds a message printf-style (without a trailing NUL).
+ * Short messages are formatted on the stack first, so they only need
+ * the one allocation.
+ */
+outmsg* outmsg_vformat(const char* fmt, va_list ap) {
+    char buf[256];
+    va_list ap2;
+
+    va_copy(ap2, ap);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if (len < 0)
+        len = 0;
+
+    // vsnprintf always writes a NUL, so format into len+1 bytes and
+    // leave the NUL in the (unused) byte past the end of the message
+    outmsg* m = outmsg_new(len + 1);
+    m->len = len;
+    if (len < sizeof(buf))
+        memcpy(m->data, buf, len);
+    else
+        vsnprintf(m->data, len + 1, fmt, ap2);
+    va_end(ap2);
+    return m;
+}
+
+outmsg* outmsg_format(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    outmsg* m = outmsg_vformat(fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+/***************************************************************************
+ * outmsg_ref takes another reference to a message (returning it, for
+ * convenience), and outmsg_unref drops one, freeing the message when
+ * the last reference goes.
+ */
+outmsg* outmsg_ref(outmsg* m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+void outmsg_unref(outmsg* m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1)
+        free(m);
+}
+
+/***************************************************************************
+ * outq_init initializes an empty queue.
+ */
+void outq_init(outq* q) {
+    q->ring = q->small;
+    pthread_mutex_init(&q->lock, NULL);
+    q->capacity = (max_msgs < OUTQ_MINRING) ? max_msgs : OUTQ_MINRING;
+    q->head = 0;
+    atomic_init(&q->count, 0);
+    q->offset = 0;
+    q->sending = 0;
+    q->dead = 0;
+    q->dropped = 0;
+}
+
+/***************************************************************************
+ * Set the number of queued messages. Only done with the lock held, but
+ * outq_backlogged reads it without the lock.
+ */
+static inline void set_count(outq* q, int count) {
+    atomic_store_explicit(&q->count, count, memory_order_relaxed);
+}
+
+/***************************************************************************
+ * Move the queued messages to a ring twice the size (but no bigger than
+ * the limit), oldest first. Only the ring moves, not the messages, so
+ * this is safe even while some of them are claimed by a send. Caller
+ * holds the lock.
+ */
+static void grow(outq* q) {
+    int capacity = (2 * q->capacity < max_msgs) ? 2 * q->capacity : max_msgs;
+    outmsg** ring = malloc(capacity * sizeof(outmsg*));
+    if (ring == NULL) {
+        perror("outq - growing queue");
+        exit(1);
+    }
+    for (int i = 0; i < q->count; i++)
+        ring[i] = q->ring[(q->head + i) % q->capacity];
+    if (q->ring != q->small)
+        free(q->ring);
+    q->ring = ring;
+    q->capacity = capacity;
+    q->head = 0;
+}
+
+/***************************************************************************
+ * Called when the queue has just become empty: go back to the small
+ * ring, giving a big one back to the heap. Caller holds the lock.
+ */
+static void drained(outq* q) {
+    if (q->ring != q->small) {
+        free(q->ring);
+        q->ring = q->small;
+        q->capacity = (max_msgs < OUTQ_MINRING) ? max_msgs : OUTQ_MINRING;
+    }
+    q->head = 0;
+    q->offset = 0;
+}
+
+/***************************************************************************
+ * Free every queued message, except any claimed by a send still in
+ * flight (those go when it completes). Caller holds the lock (or is the
+ * only user).
+ */
+static void discard_all(outq* q) {
+    for (int i = q->sending; i < q->count; i++)
+        outmsg_unref(q->ring[(q->head + i) % q->capacity]);
+    set_count(q, q->sending);
+    if (q->count == 0)
+        drained(q);
+}
+
+/***************************************************************************
+ * outq_destroy frees anything still in the queue.
+ */
+void outq_destroy(outq* q) {
+    discard_all(q);
+    if (q->ring != q->small)
+        free(q->ring);
+    q->ring = NULL;
+    pthread_mutex_destroy(&q->lock);
+}
+
+/***************************************************************************
+ * outq_push adds message "m" to the end of the queue, which takes over
+ * the caller's reference to it. Returns false if the player should be
+ * disconnected (its queue overflowed under the disconnect policy, or it
+ * is already on its way out), true otherwise.
+ */
+int outq_push(outq* q, outmsg* m) {
+    metrics_lock(&q->lock, METRIC_LOCK_OUTQ);
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        outmsg_unref(m);
+        return 0;
+    }
+
+    if ((q->count == q->capacity) && (q->capacity < max_msgs))
+        grow(q);
+    if (q->count == q->capacity) {
+        if ((overflow_policy == OUTQ_DISCONNECT) || (max_msgs < 2)) {
+            q->dead = 1;
+            discard_all(q);
+            pthread_mutex_unlock(&q->lock);
+            outmsg_unref(m);
+            metrics_count(METRIC_SLOW_DISCONNECTS, 1);
+            return 0;
+        }
+
+        // Drop the oldest message that hasn't been partly written (a
+        // half-written message can't be taken back off the wire), or
+        // claimed by a send. If they all have, drop the new one.
+        int victim = (q->sending > 0) ? q->sending : (q->offset > 0) ? 1 : 0;
+        if (victim == q->count) {
+            q->dropped++;
+            pthread_mutex_unlock(&q->lock);
+            outmsg_unref(m);
+            metrics_count(METRIC_DROPPED, 1);
+            return 1;
+        }
+        int idx = (q->head + victim) % q->capacity;
+        outmsg_unref(q->ring[idx]);
+        for (int i = victim; i > 0; i--)
+            q->ring[(q->head + i) % q->capacity] = q->ring[(q->head + i - 1) % q->capacity];
+        q->head = (q->head + 1) % q->capacity;
+        set_count(q, q->count - 1);
+        q->dropped++;
+        metrics_count(METRIC_DROPPED, 1);
+    }
+
+    q->ring[(q->head + q->count) % q->capacity] = m;
+    int depth = q->count + 1;
+    set_count(q, depth);
+    pthread_mutex_unlock(&q->lock);
+    metrics_count(METRIC_ENQUEUED, 1);
+    metrics_observe(METRIC_HIST_QDEPTH, depth);
+    return 1;
+}
+
+/***************************************************************************
+ * Total length of an iovec array.
+ */
+static size_t iov_total(struct iovec* iov, int niov) {
+    size_t total = 0;
+    for (int i = 0; i < niov; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+/***************************************************************************
+ * outq_flush writes as much of the queue to socket "fd" as it will take
+ * without blocking, handing up to OUTQ_MAXIOV messages to the kernel
+ * per system call. Returns 0 if the queue is now empty, 1 if the socket
+ * filled up (the rest goes when it becomes writable) or an asynchronous
+ * send has the queue (the rest goes when it completes), or -1 if the
+ * connection is broken.
+ */
+int outq_flush(outq* q, int fd) {
+    int ret = 0;
+    struct iovec iov[OUTQ_MAXIOV];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+
+    metrics_lock(&q->lock, METRIC_LOCK_OUTQ);
+    if (q->sending > 0)
+        ret = 1;
+    while ((q->count > 0) && (q->sending == 0)) {
+        int niov = (q->count < OUTQ_MAXIOV) ? q->count : OUTQ_MAXIOV;
+        for (int i = 0; i < niov; i++) {
+            outmsg* m = q->ring[(q->head + i) % q->capacity];
+            iov[i].iov_base = m->data;
+            iov[i].iov_len = m->len;
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base + q->offset;
+        iov[0].iov_len -= q->offset;
+        mh.msg_iovlen = niov;
+
+        TRACE_START(trace_start);
+        ssize_t n = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        TRACE_END(trace_start, TRACE_SENDMSG, n);
+        metrics_count(METRIC_WRITES, 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                ret = 1;
+            } else {
+                q->dead = 1;
+                discard_all(q);
+                ret = -1;
+            }
+            break;
+        }
+        metrics_count(METRIC_BYTES_OUT, n);
+
+        // Release every message that went out completely
+        size_t left = n;
+        while ((q->count > 0) && (left > 0)) {
+            outmsg* m = q->ring[q->head];
+            size_t rest = m->len - q->offset;
+            if (left < rest) {
+                q->offset += left;
+                break;
+            }
+            left -= rest;
+            outmsg_unref(m);
+            q->head = (q->head + 1) % q->capacity;
+            set_count(q, q->count - 1);
+            q->offset = 0;
+        }
+        if (q->count == 0)
+            drained(q);
+
+        if ((size_t)n < iov_total(iov, niov)) {
+            ret = 1;  // Short write -- the socket buffer is full
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/***************************************************************************
+ * outq_claim hands the front of the queue -- up to "maxiov" messages --
+ * to an asynchronous send, filling in "iov" with their data (less
+ * whatever of the first has already been written). The messages stay
+ * queued until the send reports how much went out (outq_sent) and is
+ * finished (outq_unclaim), and meanwhile outq_flush leaves the queue
+ * alone. Returns the number of messages claimed: 0 if the queue is
+ * empty, dead, or already claimed.
+ */
+int outq_claim(outq* q, struct iovec* iov, int maxiov) {
+    metrics_lock(&q->lock, METRIC_LOCK_OUTQ);
+    int n = 0;
+    if (!q->dead && (q->sending == 0)) {
+        n = (q->count < maxiov) ? q->count : maxiov;
+        for (int i = 0; i < n; i++) {
+            outmsg* m = q->ring[(q->head + i) % q->capacity];
+            iov[i].iov_base = m->data;
+            iov[i].iov_len = m->len;
+        }
+        if (n > 0) {
+            iov[0].iov_base = (char*)iov[0].iov_base + q->offset;
+            iov[0].iov_len -= q->offset;
+        }
+        q->sending = n;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/***************************************************************************
+ * outq_sent releases the first "n" bytes of claimed messages, which an
+ * asynchronous send has written.
+ */
+void outq_sent(outq* q, size_t n) {
+    metrics_count(METRIC_WRITES, 1);
+    metrics_count(METRIC_BYTES_OUT, n);
+
+    metrics_lock(&q->lock, METRIC_LOCK_OUTQ);
+    while ((q->sending > 0) && (n > 0)) {
+        outmsg* m = q->ring[q->head];
+        size_t rest = m->len - q->offset;
+        if (n < rest) {
+            q->offset += n;
+            break;
+        }
+        n -= rest;
+        outmsg_unref(m);
+        q->head = (q->head + 1) % q->capacity;
+        set_count(q, q->count - 1);
+        q->sending--;
+        q->offset = 0;
+    }
+    if (q->count == 0)
+        drained(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/***************************************************************************
+ * outq_unclaim ends an asynchronous send, once every part of it has
+ * completed: "ok" is false if any part failed, which breaks the
+ * connection. Returns like outq_flush: -1 if the connection is broken,
+ * otherwise 1 if there is more to send and 0 if not.
+ */
+int outq_unclaim(outq* q, int ok) {
+    metrics_lock(&q->lock, METRIC_LOCK_OUTQ);
+    q->sending = 0;
+    if (!ok || q->dead) {
+        q->dead = 1;
+        discard_all(q);
+    }
+    int ret = q->dead ? -1 : (q->count > 0);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/***************************************************************************
+ * outq_backlogged is true when the queue is at least half full (of its
+ * limit, not of however big its ring is right now). This is only a hint
+ * (it doesn't lock), used to push back on a client that sends requests
+ * faster than it reads the answers.
+ */
+int outq_backlogged(outq* q) {
+    int count = atomic_load_explicit(&q->count, memory_order_relaxed);
+    return (count > 0) && (2 * count >= max_msgs);
+}
+
+/***************************************************************************
+ * outq_get_stats fills in the server-wide counters (added up from every
+ * thread's metrics).
+ */
+void outq_get_stats(outq_stats* stats) {
+    stats->enqueued = metrics_total(METRIC_ENQUEUED);
+    stats->dropped = metrics_total(METRIC_DROPPED);
+    stats->disconnected = metrics_total(METRIC_SLOW_DISCONNECTS);
+    stats->bytes_sent = metrics_total(METRIC_BYTES_OUT);
+    stats->writes = metrics_total(METRIC_WRITES);
+}
@@ -0,0 +1,86 @@
+// Prototypes for the outq (outbound message queue) module
+
+#ifndef _OUTQ_H
+#define _OUTQ_H
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// Default limit on queued messages per player
+
+#define OUTQ_DEF_MAXMSGS 1024
+
+// Messages a queue can hold without allocating anything. A longer queue
+// gets a ring from the heap, doubled as needed up to the limit, and
+// gives it back once it has drained, so an idle player stays small.
+
+#define OUTQ_MINRING 8
+
+// Most messages handed to the kernel in one sendmsg call
+
+#define OUTQ_MAXIOV 64
+
+// What to do when a message is sent to a player whose queue is full
+
+#define OUTQ_DROP_OLDEST 0
+#define OUTQ_DISCONNECT 1
+
+// One formatted message, ready to go out on the wire. Messages are
+// immutable once built and reference counted, so a broadcast is
+// formatted once and the same buffer sits in every recipient's queue.
+
+typedef struct {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} outmsg;
+
+// A player's queue of messages that have not been written yet. The
+// ring holds at most the configured number of messages; "offset" is how
+// much of the first message has already been written.
+
+typedef struct {
+    pthread_mutex_t lock;
+    outmsg** ring;        // "small", or a bigger one from the heap
+    int capacity;         // Size of the ring (not the queue's limit)
+    int head;             // Index of the oldest message
+    atomic_int count;     // Number of queued messages (changed under
+                          // the lock, but read without it too)
+    size_t offset;        // Bytes of the oldest message already written
+    int sending;          // Oldest messages claimed by an async send
+    int dead;             // Set once the player is being disconnected
+    unsigned long dropped;  // Messages this player never got
+    outmsg* small[OUTQ_MINRING];  // The ring while the queue is short
+} outq;
+
+// Server-wide counters
+
+typedef struct {
+    unsigned long enqueued;      // Messages queued
+    unsigned long dropped;       // Messages dropped due to a full queue
+    unsigned long disconnected;  // Slow consumers disconnected
+    unsigned long bytes_sent;    // Bytes written to sockets
+    unsigned long writes;        // System calls made to write them
+} outq_stats;
+
+void outq_configure(int maxmsgs, int policy);
+outmsg* outmsg_new(size_t len);
+outmsg* outmsg_vformat(const char* fmt, va_list ap);
+outmsg* outmsg_format(const char* fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+outmsg* outmsg_ref(outmsg* m);
+void outmsg_unref(outmsg* m);
+void outq_init(outq* q);
+void outq_destroy(outq* q);
+int outq_push(outq* q, outmsg* m);
+int outq_flush(outq* q, int fd);
+int outq_claim(outq* q, struct iovec* iov, int maxiov);
+void outq_sent(outq* q, size_t n);
+int outq_unclaim(outq* q, int ok);
+int outq_backlogged(outq* q);
+void outq_get_stats(outq_stats* stats);
+
+#endif  // _OUTQ_H
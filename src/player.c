@@ -1,73 +1,189 @@
 // The player module contains the player data type and management functions
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
-#include <string.h>
+#include <sys/socket.h>
 
+#include "slab.h"
 #include "player.h"
 
+// Players are allocated from a slab cache, so a connection is one
+// fixed-size object that is recycled rather than freed when the player
+// disconnects. Its outbound queue only allocates while it is long.
+
+static slab_cache players;
+
+/************************************************************************
+ * player_pool_init sets up the cache of player structs. Should be called
+ * once at the beginning of main.
+ */
+void player_pool_init(void) {
+    slab_cache_init(&players, "players", sizeof(player_info),
+                    SLAB_DEF_PERSLAB);
+}
+
 /************************************************************************
  * player_init initializes an player structure in the initial PLAYER_UNREG
- * state, with given send and receive FILE objects.
+ * state, for the given socket.
  */
-void player_init(player_info* player, FILE *fp_send, FILE *fp_recv) {
+void player_init(player_info* player, int fd) {
     player->state = PLAYER_UNREG;
+    player->proto = PLAYER_UNDECIDED;
     player->in_room = 0;
-    player->thread = 0;
-    player->fp_send = fp_send;
-    player->fp_recv = fp_recv;
+    player->fd = fd;
+    player->handle = 0;
+    player->indexed = 0;
+    outq_init(&player->out);
+    atomic_init(&player->corked, 0);
+    atomic_init(&player->flush_pending, 0);
+    player->rlen = 0;
+    player->rscan = 0;
+    player->rdiscard = 0;
+    player->rstalled = 0;
+    player->reactor = 0;
+    player->conn = NULL;
+    cmdq_init(&player->cmds);
     player->name[0] = '\0';
 }
 
 /************************************************************************
- * new_player allocates a player struct and initializes it for
- * file descriptor "comm_fd". If any of the setup fails, this returns
+ * new_player allocates a player struct from the pool and initializes it
+ * for file descriptor "comm_fd". If any of the setup fails, this returns
  * NULL (should never happen?).
+ *
+ * Input is read directly from comm_fd by the reactor, and output goes
+ * through the player's outbound queue; both use MSG_DONTWAIT, so the
+ * socket itself can stay in blocking mode.
  */
 player_info* new_player(int comm_fd) {
-    player_info* ret = malloc(sizeof(player_info));
-    if (ret == NULL) {
-        perror("new_player");
-        exit(1);
-    }
+    player_info* ret = slab_alloc(&players);
+    player_init(ret, comm_fd);
+    return ret;
+}
 
-    // Duplicate the file descriptor so we have separare read and write fds
-    // There may be a better way to do this, but using the same fd for both
-    // read and write seems to confuse the position in I/O buffering.
-    int dup_fd = dup(comm_fd);
-    if (dup_fd < 0) {
-        perror("new_player dup");
-        free(ret);
-        return NULL;
-    }
+/************************************************************************
+ * player_release returns a destroyed player struct to the pool. Can be
+ * called from any thread.
+ */
+void player_release(player_info* player) {
+    slab_free(player);
+}
+
+/************************************************************************
+ * player_get_pool_stats reports how full the pool of player structs is.
+ */
+void player_get_pool_stats(slab_stats* stats) {
+    slab_get_stats(&players, stats);
+}
 
-    // Wrap the original fd in a FILE* for buffered/formatted writing
-    FILE *sender = fdopen(comm_fd, "w");
-    if (sender == NULL) {
-        perror("new_player fd_open sender");
-        close(dup_fd);
-        close(comm_fd);
-        free(ret);
-        return NULL;
+/************************************************************************
+ * player_queue adds a ready-made message to the player's outbound queue
+ * (taking over the caller's reference to it) and, unless the player is
+ * corked, writes out as much of the queue as the socket will take right
+ * now. Never blocks. If the player can't keep up and the overflow policy
+ * says to disconnect it, its connection is shut down, which wakes up
+ * its reactor to finish the job.
+ */
+void player_queue(player_info* player, outmsg* m) {
+    if (!outq_push(&player->out, m)) {
+        shutdown(player->fd, SHUT_RDWR);
+        return;
     }
+    if (!atomic_load(&player->corked))
+        player_flush(player);
+}
 
-    // Wrap the duplicate fd in a FILE* for buffered/formatted reading
-    FILE *receiver = fdopen(dup_fd, "r");
-    if (receiver == NULL) {
-        perror("new_player fd_open receiver");
-        fclose(sender);
-        close(dup_fd);
-        free(ret);
-        return NULL;
+/************************************************************************
+ * player_queue_later adds a message to the player's outbound queue like
+ * player_queue, but doesn't write it: the caller batches up the players
+ * it sends to and flushes each once, with player_flush_deferred, at the
+ * end of its batch of work (see pllist.c). So however many messages a
+ * player is sent in one batch, they go out in one write. Returns true if
+ * the caller must do that flush -- false if the player is corked, or
+ * some other thread has already promised to flush it.
+ *
+ * Whoever finds flush_pending clear sets it and does the flushing; the
+ * flusher clears it before flushing, and senders push before they check,
+ * so every message is written by someone.
+ */
+int player_queue_later(player_info* player, outmsg* m) {
+    if (!outq_push(&player->out, m)) {
+        shutdown(player->fd, SHUT_RDWR);
+        return 0;
     }
+    return !atomic_load(&player->corked) &&
+           !atomic_exchange(&player->flush_pending, 1);
+}
 
-    // Set both FILE*'s to be line buffered (line-oriented app protocol)
+/************************************************************************
+ * player_flush_deferred does the flush promised by player_queue_later.
+ */
+void player_flush_deferred(player_info* player) {
+    atomic_store(&player->flush_pending, 0);
+    player_flush(player);
+}
+
+/************************************************************************
+ * player_send formats a message (printf style) and queues it for the
+ * player.
+ */
+void player_send(player_info* player, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    outmsg* m = outmsg_vformat(fmt, ap);
+    va_end(ap);
+    player_queue(player, m);
+}
 
-    setvbuf(sender, NULL, _IOLBF, 0);
-    setvbuf(receiver, NULL, _IOLBF, 0);
+/************************************************************************
+ * player_flush writes out as much of the player's queue as possible.
+ * Called after queueing, and by the reactor when the socket becomes
+ * writable again.
+ */
+void player_flush(player_info* player) {
+    if (outq_flush(&player->out, player->fd) < 0)
+        shutdown(player->fd, SHUT_RDWR);
+}
 
-    player_init(ret, sender, receiver);
-    return ret;
+/************************************************************************
+ * player_backlogged is true when the player's queue is at least half
+ * full, and the reactor should stop running its commands until the
+ * client reads some of the responses.
+ */
+int player_backlogged(player_info* player) {
+    return outq_backlogged(&player->out);
+}
+
+/************************************************************************
+ * player_cork and player_uncork bracket a batch of work for the player
+ * (the reactor corks a player while running all the commands from one
+ * read). In between, anything queued for the player -- its responses,
+ * but also messages from other threads -- just piles up in the queue,
+ * and uncorking writes it all with one gather write instead of a write
+ * per message.
+ *
+ * A sender on another thread pushes before it checks the flag, and the
+ * owner clears the flag before it flushes, so every message is written
+ * by one of the two.
+ */
+void player_cork(player_info* player) {
+    atomic_store(&player->corked, 1);
+}
+
+void player_uncork(player_info* player) {
+    atomic_store(&player->corked, 0);
+    player_flush(player);
+}
+
+/************************************************************************
+ * player_uncork_noflush uncorks without writing, for a caller that will
+ * write the queue itself (the io_uring reactor, which sends it
+ * asynchronously).
+ */
+void player_uncork_noflush(player_info* player) {
+    atomic_store(&player->corked, 0);
 }
 
 /************************************************************************
@@ -78,6 +194,7 @@ player_info* new_player(int comm_fd) {
  */
 void player_destroy(player_info* player) {
     player->state = PLAYER_DONE;  // Just to make sure....
-    fclose(player->fp_send);
-    fclose(player->fp_recv);
+    outq_destroy(&player->out);
+    cmdq_destroy(&player->cmds);
+    close(player->fd);
 }
@@ -1,13 +1,22 @@
 #ifndef _PLAYER_H
 #define _PLAYER_H
 
-#include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "outq.h"
+#include "executor.h"
+#include "slab.h"
 
 // The maximum length of a player name
 
 #define PLAYER_MAXNAME 20
 
+// The size of the per-connection read buffer. This is the longest line
+// accepted, and also how much pipelined input is handled per read.
+
+#define PLAYER_RBUFSIZE 4096
+
 // These are the valid states of a player. The numbers don't mean
 // anything, and just need to be all different. Note that a more
 // "modern" way of doing this would be to use an "enum", but most C
@@ -18,22 +27,57 @@
 #define PLAYER_REG 1
 #define PLAYER_DONE 2
 
+// Which protocol a player speaks. Connections start out undecided (and
+// are answered in text) until their first byte says which.
+
+#define PLAYER_UNDECIDED 0
+#define PLAYER_TEXT 1
+#define PLAYER_BINARY 2
+
 // The struct to keep track of all information about a player in
 // the system.
 
 typedef struct player_info {
     char name[PLAYER_MAXNAME+1];
     int state;
+    int proto;                   // PLAYER_TEXT or PLAYER_BINARY
     int in_room;
-    FILE* fp_send;
-    FILE* fp_recv;
-    pthread_t thread;
+    int fd;                      // The connection socket
+    uint64_t handle;             // Slot and generation in the player list
+    outq out;                    // Messages waiting to be sent
+    atomic_int corked;           // While set, queueing doesn't write
+    atomic_int flush_pending;    // Some thread will flush it (queue_later)
+    int indexed;                 // True if in its room's roster
+    size_t rlen;                 // Bytes of rbuf currently in use
+    size_t rscan;                // Bytes of rbuf known to have no newline
+    int rdiscard;                // Skipping an overlong line (or frame)
+    int rstalled;                // Input paused (output backlog, or moving)
+    int reactor;                 // The reactor serving its connection
+    void* conn;                  // ...and its state there, if any
+    cmdq cmds;                   // Commands waiting for a worker (executor.c)
+    char rbuf[PLAYER_RBUFSIZE];  // Partial input lines read so far
 } player_info;
 
 // Basic allocation/initializer and destructor functions
 
-void player_init(player_info* player, FILE *fp_send, FILE *fp_recv);
+void player_pool_init(void);
+void player_init(player_info* player, int fd);
 player_info* new_player(int comm_fd);
 void player_destroy(player_info* player);
+void player_release(player_info* player);
+void player_get_pool_stats(slab_stats* stats);
+
+// Sending to a player (from any thread)
+
+void player_send(player_info* player, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void player_queue(player_info* player, outmsg* m);
+int player_queue_later(player_info* player, outmsg* m);
+void player_flush_deferred(player_info* player);
+void player_flush(player_info* player);
+int player_backlogged(player_info* player);
+void player_cork(player_info* player);
+void player_uncork(player_info* player);
+void player_uncork_noflush(player_info* player);
 
 #endif  // _PLAYER_H
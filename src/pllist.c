@@ -1,33 +1,89 @@
-// This module is built on top of alist.h, to provide for a threadsafe
-// list of players in the system. There is one global list, managed
-// by this module, and it is locked any time the list is accessed or
-// changed in some way. The lock can also apply to changes within a
-// player struct, so things like changing the player name can go here
-// to make sure there are not thread-safety issues.
+// This module is built on top of pltab.h, to provide for a threadsafe
+// list of players in the system. Every player has a handle into the
+// list (its slot), so adding and removing a player is O(1) no matter
+// how many are connected.
+//
+// Registered players are also kept in their room's roster (see room.c),
+// so that room listings and announcements only have to look at the
+// players in that one room instead of scanning everybody on the server,
+// and in a hash table by name, so LOGIN and MSG can find a player
+// without a scan.
+//
+// There is no global lock. The list and the name table are split into
+// shards, each with its own lock: a player goes into the list shard of
+// the thread that accepted it (so connects and disconnects on different
+// reactors never meet), and into the name shard picked by the hash of
+// its name (so logins only collide when they hash to the same shard).
+// Rooms have a lock each (see room.c). No operation holds more than one
+// shard lock, and none holds a shard lock while it takes a room lock.
+//
+// Reading is lock-free (see rcu.c): rosters are never changed in place,
+// writers build a new copy and publish it with a single pointer store,
+// and name lookups run alongside the writer. Old rosters and removed
+// players are only freed once no reader can still be looking at them,
+// so LIST, announcements and MSG never touch a lock or write to shared
+// memory. The locks are only taken by writers.
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
-#include "alist.h"
+#include "rcu.h"
+#include "metrics.h"
+#include "pltab.h"
+#include "nametab.h"
+#include "room.h"
+#include "frame.h"
+#include "history.h"
 #include "pllist.h"
 
-// The list of all players
+// One shard of the list of all players, and one of the registered
+// players by name. Each sits on its own cache lines, so writers in
+// different shards don't slow each other down.
 
-static alist all_players;
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    pltab players;
+} player_shard;
 
-// A global lock, to ensure that the list doesn't change when being accessed
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    nametab names;
+} name_shard;
 
-static pthread_rwlock_t listlock;
+static player_shard player_shards[PLLIST_NSHARDS];
+static name_shard name_shards[PLLIST_NSHARDS];
+
+// The list shard used by the calling thread (-1 until it adds a player)
+
+static __thread int my_shard = -1;
+static atomic_int next_shard;
+
+// Handles of the players this thread has queued announcements and
+// messages for, which it must flush (see queue_later)
+
+static __thread uint64_t* pending;
+static __thread int npending;
+static __thread int pending_cap;
 
 /***************************************************************************
- * Callback function for use by the list routines to destroy and free a
- * player_info struct.
+ * Callback function to destroy and free a player_info struct.
  */
 void player_free(void* p) {
     player_info* ap = (player_info*)p;
     player_destroy(ap);
-    free(ap);
+    player_release(ap);
+}
+
+/***************************************************************************
+ * Destructor for a player taken out of the list: readers may still be
+ * looking at the player, so the actual free waits for an RCU grace
+ * period.
+ */
+static void player_retire(void* p) {
+    rcu_retire(p, player_free);
 }
 
 /***************************************************************************
@@ -35,48 +91,61 @@ void player_free(void* p) {
  * of main, when the program starts up.
  */
 void pllist_init(void) {
-    alist_init(&all_players, player_free);
-    pthread_rwlock_init(&listlock, NULL);
+    for (int i = 0; i < PLLIST_NSHARDS; i++) {
+        pthread_mutex_init(&player_shards[i].lock, NULL);
+        pltab_init(&player_shards[i].players, i);
+        pthread_mutex_init(&name_shards[i].lock, NULL);
+        nametab_init(&name_shards[i].names);
+    }
+    room_init();
 }
 
 /***************************************************************************
- * pllist_add adds a new player to the list.
+ * name_shard_for picks the name shard for "name".
  */
-void pllist_add(player_info* newplayer) {
-    pthread_rwlock_wrlock(&listlock);
-    alist_add(&all_players, newplayer);
-    pthread_rwlock_unlock(&listlock);
+static name_shard* name_shard_for(const char* name) {
+    return &name_shards[nametab_hash(name) >> (32 - PLLIST_SHARDBITS)];
 }
 
 /***************************************************************************
- * pllist_list lists players in the list.
+ * pllist_add adds a new player to the list, giving it its handle.
  */
-// void pllist_list(player_info* newplayer) {
+void pllist_add(player_info* newplayer) {
+    if (my_shard < 0)
+        my_shard = atomic_fetch_add(&next_shard, 1) % PLLIST_NSHARDS;
 
-// }
+    player_shard* sh = &player_shards[my_shard];
+    metrics_lock(&sh->lock, METRIC_LOCK_PLAYER_SHARD);
+    pltab_add(&sh->players, newplayer);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/***************************************************************************
+ * pllist_get returns the player with the given handle, or NULL if it has
+ * disconnected since the handle was taken. Lock-free, and like
+ * pllist_link the pointer only stays valid until the calling thread's
+ * next RCU quiescent state.
+ */
+player_info* pllist_get(uint64_t handle) {
+    return pltab_get(&player_shards[pltab_handle_shard(handle)].players,
+                     handle);
+}
 
 /***************************************************************************
  * pllist_find_nolock searches the list of players for a registered
  * player with the given name. This is only for internal use by this
- * module and does no locking - it is assume that the user of this function
- * will surround the use with the appropriate locks.
+ * module and does no locking - the name table can be read while a
+ * writer is changing it.
  */
 static player_info* pllist_find_nolock(char* name) {
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        player_info* thisplayer = alist_get(&all_players, i);
-        if ((thisplayer->state != PLAYER_UNREG) &&
-            (strcmp(thisplayer->name, name) == 0)) {
-            return thisplayer;
-        }
-    }
-
-    return NULL;
+    return nametab_find(&name_shard_for(name)->names, name);
 }
 
 /***************************************************************************
- * pllist_link links a given name to a player, the only time this
- * is used is when a name is already checked to exist but a
- * failsafe was added regardless.
+ * pllist_link links a given name to a player, returning NULL if there
+ * is no registered player with that name. Note that the pointer is only
+ * guaranteed to stay valid until the calling thread's next RCU quiescent
+ * state (for a reactor thread, until it goes back to epoll_wait).
  */
 player_info* pllist_link(char* name) {
     // If the given name is null
@@ -84,37 +153,215 @@ player_info* pllist_link(char* name) {
         printf("Error: Null name\n");
         return NULL;
     }
-    // Links the player to the given name
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        player_info* thisplayer = alist_get(&all_players, i);
-        if (thisplayer != NULL && thisplayer->state != PLAYER_UNREG &&
-            strcmp(thisplayer->name, name) == 0) {
-            return thisplayer;
+    return pllist_find_nolock(name);
+}
+
+/***************************************************************************
+ * Queue message "m" for player "to" (another player than the one this
+ * thread is working for), to be written by pllist_flush_pending. The
+ * players are remembered by handle, since in tick mode the flush may be
+ * several batches (and RCU grace periods) away.
+ */
+static void queue_later(player_info* to, outmsg* m) {
+    if (!player_queue_later(to, m))
+        return;  // Someone else will write it
+
+    if (npending == pending_cap) {
+        pending_cap = (pending_cap == 0) ? 64 : 2 * pending_cap;
+        pending = realloc(pending, pending_cap * sizeof(uint64_t));
+        if (pending == NULL) {
+            perror("pllist - queueing");
+            exit(1);
+        }
+    }
+    pending[npending++] = to->handle;
+}
+
+/***************************************************************************
+ * pllist_flush_pending writes out the queues of every player this thread
+ * has sent announcements or messages to since the last call (skipping
+ * any that have disconnected since). The reactor calls it at the end of
+ * every batch of events, or in tick mode once per tick.
+ */
+void pllist_flush_pending(void) {
+    for (int i = 0; i < npending; i++) {
+        player_info* p = pllist_get(pending[i]);
+        if (p != NULL)
+            player_flush_deferred(p);
+    }
+    npending = 0;
+}
+
+/***************************************************************************
+ * Deliver a message from player "from" to player "to", in whichever
+ * protocol "to" speaks.
+ */
+static void deliver(player_info* from, player_info* to, const char* msg,
+                    int msglen) {
+    if (to->proto == PLAYER_BINARY)
+        queue_later(to, frame_player(FRAME_FROM, from, msg, msglen));
+    else
+        queue_later(to, outmsg_format("NOTICE From %s: %.*s\n", from->name,
+                                      msglen, msg));
+}
+
+/***************************************************************************
+ * pllist_message sends a message from player "from" to the registered
+ * player named "to" ("msglen" bytes of "msg", which needn't be
+ * NUL-terminated). Even if the recipient disconnects while this is
+ * running, it won't be freed until we're done with it. Returns true if
+ * the recipient exists.
+ */
+int pllist_message(player_info* from, char* to, const char* msg, int msglen) {
+    player_info* recipient = pllist_find_nolock(to);
+    if (recipient != NULL) {
+        deliver(from, recipient, msg, msglen);
+    }
+    return (recipient != NULL);
+}
+
+/***************************************************************************
+ * pllist_message_id is pllist_message for a recipient given by its
+ * handle (as the binary protocol does). Returns true if that player
+ * exists and is logged in.
+ */
+int pllist_message_id(player_info* from, uint64_t to, const char* msg,
+                      int msglen) {
+    player_info* recipient = pllist_get(to);
+    // Logged in means found under its own name
+    if ((recipient == NULL) || (recipient->name[0] == '\0') ||
+        (pllist_find_nolock(recipient->name) != recipient))
+        return 0;
+    deliver(from, recipient, msg, msglen);
+    return 1;
+}
+
+/***************************************************************************
+ * Lists the members of roster "r" (NULL for an empty room), separated
+ * by commas, as a newly allocated string.
+ */
+static char* list_names(roster* r) {
+    int count = (r == NULL) ? 0 : r->count;
+
+    // Work out the length first, so the list is built in one allocation
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+        len += strlen(r->members[i]->name) + 2;
+
+    char* names = malloc(len + 1);
+    if (names == NULL) {
+        perror("pllist_list");
+        exit(1);
+    }
+
+    // Loops through the members of the player's room only
+    char* cp = names;
+    for (int i = 0; i < count; i++) {
+        size_t nlen = strlen(r->members[i]->name);
+        memcpy(cp, r->members[i]->name, nlen);
+        cp += nlen;
+        // List that player, if it's the last one then no comma
+        if (i < count - 1) {
+            *cp++ = ',';
+            *cp++ = ' ';
         }
     }
-    return NULL;
+    *cp = '\0';
+
+    return names;
+}
+
+/***************************************************************************
+ * Lists the last "n" changes logged in roster "r", separated by commas,
+ * each a name marked "+" (joined) or "-" (left), as a newly allocated
+ * string.
+ */
+static char* list_changes(roster* r, int n) {
+    roster_change* log = r->log + r->nlog - n;
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += strlen(log[i].name) + 3;
+
+    char* changes = malloc(len + 1);
+    if (changes == NULL) {
+        perror("pllist_list_since");
+        exit(1);
+    }
+
+    char* cp = changes;
+    for (int i = 0; i < n; i++) {
+        size_t nlen = strlen(log[i].name);
+        *cp++ = log[i].joined ? '+' : '-';
+        memcpy(cp, log[i].name, nlen);
+        cp += nlen;
+        if (i < n - 1) {
+            *cp++ = ',';
+            *cp++ = ' ';
+        }
+    }
+    *cp = '\0';
+
+    return changes;
 }
 
 /***************************************************************************
  * pllist_list lists all players within the same room as the
  * player who ran the command, the players are returned
- * separated by comma except the last player in the list.
- */
-void pllist_list(player_info* player) {
-    // Loops through the list of players
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        player_info* thisplayer = alist_get(&all_players, i);
-
-        // If a player is in the same lobby as the original player
-        if (player->in_room == thisplayer->in_room) {
-            // List that player, if it's the last one then no comma
-            if (i == alist_size(&all_players) - 1) {
-                fprintf(player->fp_send, "%s", thisplayer->name);
-            } else {
-                fprintf(player->fp_send, "%s, ", thisplayer->name);
-            }
+ * separated by comma except the last player in the list. The list is
+ * returned as a newly allocated string, which the caller must free.
+ */
+char* pllist_list(player_info* player) {
+    return list_names(room_snapshot(player->in_room));
+}
+
+/***************************************************************************
+ * pllist_list_since lists only what has changed in the player's room
+ * since roster version "since" (see list_changes). If the room's log
+ * doesn't reach back that far, or "since" is from another room, it lists
+ * all the players instead, as pllist_list does. Either way "*version" is
+ * set to the version listed. The list is returned as a newly allocated
+ * string, which the caller must free.
+ */
+char* pllist_list_since(player_info* player, uint64_t since,
+                        uint64_t* version) {
+    roster* r = room_snapshot(player->in_room);
+    *version = (r == NULL) ? 0 : r->version;
+    int n = room_changes(r, since);
+    return (n < 0) ? list_names(r) : list_changes(r, n);
+}
+
+/***************************************************************************
+ * Tell every member of roster "r" except "skip" about something "player"
+ * did: text members get "fmt" formatted with the player's name and the
+ * "msglen" bytes of "msg" (as "%s" and "%.*s"; a format with no use for
+ * the message just leaves it out), and binary ones a frame of type
+ * "type" carrying the same. Each form is built once, the first time it
+ * is needed, and every member gets a reference to it. The writes wait
+ * for the end of this thread's batch (or tick), so a member sent several
+ * things meanwhile gets them in one write.
+ */
+static void announce(roster* r, player_info* player, player_info* skip,
+                     const char* fmt, int type, const char* msg, int msglen) {
+    outmsg* text = NULL;
+    outmsg* bin = NULL;
+    for (int i = 0; i < r->count; i++) {
+        player_info* to = r->members[i];
+        if (to == skip)
+            continue;
+        if (to->proto == PLAYER_BINARY) {
+            if (bin == NULL)
+                bin = frame_player(type, player, msg, msglen);
+            queue_later(to, outmsg_ref(bin));
+        } else {
+            if (text == NULL)
+                text = outmsg_format(fmt, player->name, msglen, msg);
+            queue_later(to, outmsg_ref(text));
         }
     }
+    if (text != NULL)
+        outmsg_unref(text);
+    if (bin != NULL)
+        outmsg_unref(bin);
 }
 
 /***************************************************************************
@@ -122,69 +369,124 @@ void pllist_list(player_info* player) {
  * arena as the other players in that arena, to said players.
  */
 void pllist_announce_arrival(player_info* player) {
-    // Loops through the player list
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        player_info* thisplayer = alist_get(&all_players, i);
-        // Finds players in the lobby and sends them a message about
-        // The new player joining, this is also sent to the player who joined.
-        if (player->in_room == thisplayer->in_room) {
-            fprintf(thisplayer->fp_send, "%s has joined the room!", player->name);
-            fprintf(thisplayer->fp_send, "\n");
-        }
-    }
+    roster* r = room_snapshot(player->in_room);
+    if (r == NULL)
+        return;
+
+    // Sends every member of the room a message about the new player
+    // joining, this is also sent to the player who joined.
+    announce(r, player, NULL, "%s has joined the room!\n", FRAME_JOINED,
+             "", 0);
 }
 
 /***************************************************************************
- * pllist_announce_departure announces when a player leaves the same
- * arena as the other players in that arena, to said players.
+ * pllist_announce_departure announces when a player leaves room "room"
+ * to the other players in that room.
  */
-void pllist_announce_departure(player_info* player) {
-    // Loops through the player list
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        player_info* thisplayer = alist_get(&all_players, i);
-        // Finds players in the lobby and sends them a message about
-        // The other player leaving, this isnt sent to the player who left.
-        if (player->in_room == thisplayer->in_room && !(strcmp(thisplayer->name, player->name) == 0)) {
-            fprintf(thisplayer->fp_send, "%s has left the room!", player->name);
-            fprintf(thisplayer->fp_send, "\n");
-        }
-    }
+void pllist_announce_departure(player_info* player, int room) {
+    roster* r = room_snapshot(room);
+    if (r == NULL)
+        return;
+
+    // Sends every other member of the room a message about the player
+    // leaving, this isnt sent to the player who left.
+    announce(r, player, player, "%s has left the room!\n", FRAME_LEFT,
+             "", 0);
+}
+
+/***************************************************************************
+ * pllist_say sends a message ("msglen" bytes of "msg") from a player to
+ * everyone else in its room, and keeps it in the room's history. The
+ * message is formatted once (per protocol) however big the room is.
+ */
+void pllist_say(player_info* player, const char* msg, int msglen) {
+    roster* r = room_snapshot(player->in_room);
+    if (r == NULL)
+        return;
+    announce(r, player, player, "NOTICE %s says: %.*s\n", FRAME_SAID, msg,
+             msglen);
+    history_append(r->room, player, msg, msglen);
+}
+
+/***************************************************************************
+ * pllist_moveto moves a registered player from its current room into
+ * room "room", keeping the room index up to date. Returns false if there
+ * is no such room (it may have just been reclaimed).
+ */
+int pllist_moveto(player_info* player, int room) {
+    return room_move(player, room);
+}
+
+/***************************************************************************
+ * pllist_create creates a new room and moves a registered player into
+ * it, returning the new room's id. Returns -1 if no more rooms can be
+ * made, or -2 if the room was gone before the player got into it (room
+ * ids can be guessed, so someone else can move in and out first, and
+ * the room is reclaimed when they leave).
+ */
+int pllist_create(player_info* player) {
+    int room = room_create();
+    if ((room >= 0) && !room_move(player, room))
+        return -2;
+    return room;
+}
+
+/***************************************************************************
+ * pllist_leave announces that a player is leaving the game, and takes
+ * it out of its room (so it is no longer listed or sent announcements).
+ */
+void pllist_leave(player_info* player) {
+    // Only registered players are in a room, so nobody to tell otherwise
+    if (!player->indexed)
+        return;
+
+    pllist_announce_departure(player, player->in_room);
+    room_unlink(player);
 }
 
 /***************************************************************************
  * pllist_exists checks the list of players to see if a registered
  * player with the given name, and if no such player is in the list
- * then it sets the name of "player" to "name". Returns true/false
- * depending on whether the player was added (true means successfully
- * added).
+ * then it sets the name of "player" to "name" and adds it to the index
+ * for its room. Returns true/false depending on whether the player was
+ * added (true means successfully added).
  */
 int pllist_addifnew(player_info* player, char* name) {
-    int success = 0;
-    pthread_rwlock_wrlock(&listlock);
-    player_info* thisplayer = pllist_find_nolock(name);
-    if (thisplayer == NULL) {
-        strcpy(player->name, name);
-        success = 1;
-    }
-    pthread_rwlock_unlock(&listlock);
+    name_shard* sh = name_shard_for(name);
+    metrics_lock(&sh->lock, METRIC_LOCK_NAME_SHARD);
+    // Lock-free readers check the player's own name, so set it first
+    strcpy(player->name, name);
+    int success = nametab_insert(&sh->names, name, player);
+    pthread_mutex_unlock(&sh->lock);
+
+    if (success)
+        room_link(player);
+    else
+        player->name[0] = '\0';
     return success;
 }
 
 /***************************************************************************
- * pllist_remove scans the list of players for the specific struct
- * passed in, and then removes it from the list. Typically this is called
- * from a thread for their own player_info before the thread exits.
+ * pllist_remove takes the player passed in out of the list (found by its
+ * handle, so no scan), and frees it once nobody can be looking at it.
+ * Typically this is called by the reactor when the connection closes.
  */
 void pllist_remove(player_info* ditch) {
-    pthread_rwlock_wrlock(&listlock);
-    for (int i = 0; i < alist_size(&all_players); i++) {
-        if (alist_get(&all_players, i) == ditch) {
-            alist_remove(&all_players, i);
-            pthread_rwlock_unlock(&listlock);
-            return;
-        }
+    player_shard* psh = &player_shards[pltab_handle_shard(ditch->handle)];
+    metrics_lock(&psh->lock, METRIC_LOCK_PLAYER_SHARD);
+    int found = pltab_remove(&psh->players, ditch->handle);
+    pthread_mutex_unlock(&psh->lock);
+    if (!found) {
+        printf("Couldn't find player to remove - this shouldn't happen\n");
+        return;
     }
 
-    printf("Couldn't find player to remove - this shouldn't happen\n");
-    pthread_rwlock_unlock(&listlock);
+    room_unlink(ditch);
+    if (ditch->name[0] != '\0') {
+        name_shard* nsh = name_shard_for(ditch->name);
+        metrics_lock(&nsh->lock, METRIC_LOCK_NAME_SHARD);
+        nametab_remove(&nsh->names, ditch->name);
+        pthread_mutex_unlock(&nsh->lock);
+    }
+    player_retire(ditch);
 }
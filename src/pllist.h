@@ -3,14 +3,33 @@
 #ifndef _PLLIST_H
 #define _PLLIST_H
 
+#include <stdint.h>
+
 #include "player.h"
 
+// The player list and the name table are each split into this many
+// shards, with a lock apiece
+
+#define PLLIST_SHARDBITS 4
+#define PLLIST_NSHARDS (1 << PLLIST_SHARDBITS)
+
 void pllist_init(void);
 void pllist_add(player_info* newplayer);
 int pllist_addifnew(player_info* player, char* name);
 void pllist_remove(player_info* player);
+player_info* pllist_get(uint64_t handle);
 player_info* pllist_link(char* name);
-void pllist_list(player_info* player);
+int pllist_message(player_info* from, char* to, const char* msg, int msglen);
+int pllist_message_id(player_info* from, uint64_t to, const char* msg,
+                      int msglen);
+char* pllist_list(player_info* player);
+char* pllist_list_since(player_info* player, uint64_t since,
+                        uint64_t* version);
 void pllist_announce_arrival(player_info* player);
-void pllist_announce_departure(player_info* player);
+void pllist_announce_departure(player_info* player, int room);
+void pllist_say(player_info* player, const char* msg, int msglen);
+void pllist_flush_pending(void);
+int pllist_moveto(player_info* player, int room);
+int pllist_create(player_info* player);
+void pllist_leave(player_info* player);
 #endif  // _PLLIST_H
@@ -0,0 +1,159 @@
+// The player table: a slot array holding every connected player.
+
+// Each player gets a slot when it connects, and keeps it until it
+// disconnects, so its handle (slot number plus generation, see pltab.h)
+// leads straight to it. Removing a player just empties its slot and
+// puts the slot on a free list -- nothing is searched for and nothing
+// moves, however many players there are. The next player to connect
+// reuses the slot with the generation bumped, so an old handle is
+// recognized as stale instead of finding the wrong player.
+//
+// Lookups take no locks: a reader follows the published slot array and
+// confirms the player it finds there carries the handle it asked for
+// (players are freed through RCU, so it is safe to look). Growing the
+// table copies the slots into a bigger array and publishes it with one
+// pointer store; the old array is freed after an RCU grace period.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rcu.h"
+#include "pltab.h"
+
+/***************************************************************************
+ * Build a handle from a slot and generation, and take one apart.
+ */
+static inline uint64_t make_handle(pltab* t, int slot, unsigned int gen) {
+    return ((uint64_t)gen << 32) |
+           ((uint32_t)slot << PLTAB_SHARDBITS) | (uint32_t)t->shard;
+}
+
+static inline int handle_slot(uint64_t handle) {
+    return (int)((handle & 0xffffffffu) >> PLTAB_SHARDBITS);
+}
+
+/***************************************************************************
+ * pltab_handle_shard tells which table a handle came from.
+ */
+int pltab_handle_shard(uint64_t handle) {
+    return (int)(handle & (PLTAB_MAXSHARDS - 1));
+}
+
+/***************************************************************************
+ * alloc_slots allocates an array of "capacity" free slots.
+ */
+static pltab_slots* alloc_slots(int capacity) {
+    pltab_slots* tab = calloc(1, sizeof(pltab_slots) +
+                                 capacity * sizeof(pltab_slot));
+    if (tab == NULL) {
+        perror("pltab - allocating slots");
+        exit(1);
+    }
+    tab->capacity = capacity;
+    return tab;
+}
+
+/***************************************************************************
+ * pltab_init initializes an empty table with the default capacity.
+ * "shard" (less than PLTAB_MAXSHARDS) tells its handles apart from
+ * those of other tables.
+ */
+void pltab_init(pltab* t, int shard) {
+    atomic_init(&t->table, alloc_slots(PLTAB_DEF_CAPACITY));
+    t->shard = shard;
+    t->used = 0;
+    t->free_head = -1;
+    t->count = 0;
+}
+
+/***************************************************************************
+ * grow doubles the size of the slot array. The new array is private
+ * until it is published, so it can be filled without any care for
+ * readers.
+ */
+static void grow(pltab* t) {
+    pltab_slots* old = atomic_load(&t->table);
+    pltab_slots* tab = alloc_slots(2 * old->capacity);
+    memcpy(tab->slots, old->slots, t->used * sizeof(pltab_slot));
+
+    atomic_store_explicit(&t->table, tab, memory_order_release);
+    rcu_retire(old, free);
+}
+
+/***************************************************************************
+ * pltab_add puts a player in a free slot and returns its handle. The
+ * player's handle field is set before it is published. The caller must
+ * hold the writers' lock.
+ */
+uint64_t pltab_add(pltab* t, player_info* player) {
+    pltab_slots* tab = atomic_load(&t->table);
+    int slot;
+    if (t->free_head >= 0) {
+        slot = t->free_head;
+        t->free_head = tab->slots[slot].next_free;
+    } else {
+        if (t->used == tab->capacity) {
+            grow(t);
+            tab = atomic_load(&t->table);
+        }
+        slot = t->used++;
+        tab->slots[slot].gen = 1;
+    }
+
+    player->handle = make_handle(t, slot, tab->slots[slot].gen);
+    atomic_store_explicit(&tab->slots[slot].player, player,
+                          memory_order_release);
+    t->count++;
+    return player->handle;
+}
+
+/***************************************************************************
+ * pltab_get returns the player with the given handle, or NULL if that
+ * player has gone (or the handle is bogus). Lock-free; the result stays
+ * valid until the calling thread's next RCU quiescent state.
+ */
+player_info* pltab_get(pltab* t, uint64_t handle) {
+    pltab_slots* tab = atomic_load_explicit(&t->table, memory_order_acquire);
+    int slot = handle_slot(handle);
+    if ((handle == PLTAB_NOHANDLE) || (slot >= tab->capacity) ||
+        (pltab_handle_shard(handle) != t->shard))
+        return NULL;
+
+    player_info* p = atomic_load_explicit(&tab->slots[slot].player,
+                                          memory_order_acquire);
+    return ((p != NULL) && (p->handle == handle)) ? p : NULL;
+}
+
+/***************************************************************************
+ * pltab_remove empties the slot named by "handle". Returns false if the
+ * handle is stale. The caller must hold the writers' lock.
+ */
+int pltab_remove(pltab* t, uint64_t handle) {
+    pltab_slots* tab = atomic_load(&t->table);
+    int slot = handle_slot(handle);
+    if ((handle == PLTAB_NOHANDLE) || (slot >= t->used) ||
+        (pltab_handle_shard(handle) != t->shard))
+        return 0;
+
+    player_info* p = atomic_load(&tab->slots[slot].player);
+    if ((p == NULL) || (p->handle != handle))
+        return 0;
+
+    atomic_store_explicit(&tab->slots[slot].player, NULL,
+                          memory_order_release);
+    if (++tab->slots[slot].gen == 0)
+        tab->slots[slot].gen = 1;
+    tab->slots[slot].next_free = t->free_head;
+    t->free_head = slot;
+    t->count--;
+    return 1;
+}
+
+/***************************************************************************
+ * pltab_destroy frees the table (but not the players in it).
+ */
+void pltab_destroy(pltab* t) {
+    free(atomic_load(&t->table));
+    atomic_store(&t->table, NULL);
+}
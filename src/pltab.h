@@ -0,0 +1,59 @@
+// Prototypes for the player table: every connected player, by handle
+
+#ifndef _PLTAB_H
+#define _PLTAB_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "player.h"
+
+#define PLTAB_DEF_CAPACITY 64
+
+// A handle names one player for as long as it is connected: the low 32
+// bits are its slot in the table (above the number of the table, when
+// there are several), and the high 32 bits are the slot's generation,
+// which changes every time the slot is reused. So a handle kept after
+// the player has gone never finds the slot's next player. Generations
+// start at 1, so a handle of 0 is never valid.
+
+#define PLTAB_NOHANDLE 0
+#define PLTAB_SHARDBITS 4
+#define PLTAB_MAXSHARDS (1 << PLTAB_SHARDBITS)
+
+// One slot. Free slots are chained together through next_free.
+
+typedef struct {
+    _Atomic(player_info*) player;  // NULL if the slot is free
+    unsigned int gen;              // Generation of the slot's handle
+    int next_free;                 // Next free slot, -1 for none
+} pltab_slot;
+
+// The slot array is replaced as a whole when the table grows, so it
+// carries its own capacity.
+
+typedef struct {
+    int capacity;
+    pltab_slot slots[];
+} pltab_slots;
+
+// Lookups are lock-free and may run at the same time as one writer
+// (callers serialize their writers). Replaced slot arrays are freed
+// through rcu_retire, so readers must be registered RCU threads.
+
+typedef struct {
+    _Atomic(pltab_slots*) table;
+    int shard;      // Number of this table, kept in its handles
+    int used;       // Slots ever handed out; the rest are untouched
+    int free_head;  // Most recently freed slot, -1 if none
+    int count;      // Players in the table
+} pltab;
+
+void pltab_init(pltab* t, int shard);
+int pltab_handle_shard(uint64_t handle);
+uint64_t pltab_add(pltab* t, player_info* player);
+player_info* pltab_get(pltab* t, uint64_t handle);
+int pltab_remove(pltab* t, uint64_t handle);
+void pltab_destroy(pltab* t);
+
+#endif  // _PLTAB_H
@@ -0,0 +1,174 @@
+// A small quiescent-state based RCU ("read-copy-update") implementation.
+
+// Shared structures that are read much more often than they change
+// (the name table and the room rosters) are published through a single
+// pointer. Writers build a new version, swap the pointer, and hand the
+// old version to rcu_retire(). Readers just follow the pointer -- no
+// locks, no reference counts, no writes to shared memory at all.
+//
+// The catch is knowing when an old version can really be freed. Every
+// reader thread registers itself, and promises to hold no references to
+// shared structures at its "quiescent" points (for a reactor, between
+// trips around the event loop), announcing them with rcu_quiescent().
+// A retired object is tagged with a new grace-period number, and is
+// freed once every online thread has announced a quiescent state since
+// then. A thread that is about to block (in epoll_wait) goes offline so
+// nobody waits on it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rcu.h"
+
+// Per-thread state, one cache line each so that announcing a quiescent
+// state never bounces a line that another thread writes.
+
+typedef struct {
+    _Atomic unsigned long ctr;  // Last grace period seen, 0 if offline
+    char pad[64 - sizeof(unsigned long)];
+} rcu_thread;
+
+static rcu_thread threads[RCU_MAXTHREADS];
+static atomic_int nthreads;
+
+// The grace period counter, bumped once per retired object
+
+static _Atomic unsigned long gp_ctr = 1;
+
+static __thread rcu_thread* self;
+
+// Objects waiting for their grace period, oldest (smallest target) first
+
+typedef struct rcu_deferred {
+    struct rcu_deferred* next;
+    unsigned long target;  // Free once all online threads have seen this
+    void* p;
+    void (*fn)(void* p);
+} rcu_deferred;
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static rcu_deferred* pending_head;
+static rcu_deferred* pending_tail;
+static atomic_int npending;
+
+/***************************************************************************
+ * rcu_reclaim frees every retired object whose grace period has ended.
+ * If another thread is already doing this, it doesn't wait.
+ */
+static void rcu_reclaim(void) {
+    if (atomic_load(&npending) == 0)
+        return;
+
+    // The oldest grace period any online thread might still be in. It
+    // starts at the current one, not "none", so that nothing retired
+    // after this point (by a thread that comes online during the scan)
+    // can look safe even if every thread seen was offline.
+    unsigned long min = atomic_load(&gp_ctr);
+    int n = atomic_load(&nthreads);
+    for (int i = 0; i < n; i++) {
+        unsigned long c = atomic_load(&threads[i].ctr);
+        if ((c != 0) && (c < min))
+            min = c;
+    }
+
+    if (pthread_mutex_trylock(&pending_lock) != 0)
+        return;
+
+    rcu_deferred* ready = pending_head;
+    rcu_deferred* last = NULL;
+    int count = 0;
+    for (rcu_deferred* d = pending_head; (d != NULL) && (d->target <= min);
+         d = d->next) {
+        last = d;
+        count++;
+    }
+
+    if (last == NULL) {
+        ready = NULL;
+    } else {
+        pending_head = last->next;
+        if (pending_head == NULL)
+            pending_tail = NULL;
+        last->next = NULL;
+        atomic_fetch_sub(&npending, count);
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    // Run the callbacks without the lock -- they may retire more things
+    while (ready != NULL) {
+        rcu_deferred* next = ready->next;
+        ready->fn(ready->p);
+        free(ready);
+        ready = next;
+    }
+}
+
+/***************************************************************************
+ * rcu_register_thread makes the calling thread a reader. It starts out
+ * online. Should be called once, when the thread starts.
+ */
+void rcu_register_thread(void) {
+    int idx = atomic_fetch_add(&nthreads, 1);
+    if (idx >= RCU_MAXTHREADS) {
+        fprintf(stderr, "rcu_register_thread: too many threads\n");
+        exit(1);
+    }
+    self = &threads[idx];
+    atomic_store(&self->ctr, atomic_load(&gp_ctr));
+}
+
+/***************************************************************************
+ * rcu_quiescent announces that the calling thread holds no references
+ * to RCU-protected data, and frees anything that has become safe to.
+ */
+void rcu_quiescent(void) {
+    if (self == NULL)
+        return;
+    atomic_store(&self->ctr, atomic_load(&gp_ctr));
+    rcu_reclaim();
+}
+
+/***************************************************************************
+ * rcu_thread_offline is called before a registered thread blocks for a
+ * long time, and rcu_thread_online when it wakes up again. While offline
+ * the thread must not touch RCU-protected data, and nobody waits for it.
+ */
+void rcu_thread_offline(void) {
+    if (self == NULL)
+        return;
+    atomic_store(&self->ctr, 0);
+    rcu_reclaim();
+}
+
+void rcu_thread_online(void) {
+    if (self == NULL)
+        return;
+    atomic_store(&self->ctr, atomic_load(&gp_ctr));
+}
+
+/***************************************************************************
+ * rcu_retire arranges for fn(p) to be called once no reader can still
+ * hold a reference to p. The caller must already have unpublished p.
+ */
+void rcu_retire(void* p, void (*fn)(void* p)) {
+    rcu_deferred* d = malloc(sizeof(rcu_deferred));
+    if (d == NULL) {
+        perror("rcu_retire");
+        exit(1);
+    }
+    d->next = NULL;
+    d->p = p;
+    d->fn = fn;
+
+    pthread_mutex_lock(&pending_lock);
+    d->target = atomic_fetch_add(&gp_ctr, 1) + 1;
+    if (pending_tail != NULL)
+        pending_tail->next = d;
+    else
+        pending_head = d;
+    pending_tail = d;
+    atomic_fetch_add(&npending, 1);
+    pthread_mutex_unlock(&pending_lock);
+}
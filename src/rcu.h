@@ -0,0 +1,16 @@
+// Prototypes for the rcu module: quiescent-state based deferred freeing
+
+#ifndef _RCU_H
+#define _RCU_H
+
+// The most threads that can ever register as readers
+
+#define RCU_MAXTHREADS 256
+
+void rcu_register_thread(void);
+void rcu_quiescent(void);
+void rcu_thread_offline(void);
+void rcu_thread_online(void);
+void rcu_retire(void* p, void (*fn)(void* p));
+
+#endif  // _RCU_H
@@ -0,0 +1,1345 @@
+// The reactor module runs the network event loop for the arena server.
+
+// Each reactor thread owns one listening socket (all bound to the same
+// port with SO_REUSEPORT, so the kernel spreads new connections across
+// them) and an epoll instance holding every connection it accepted.
+// Sockets are watched edge-triggered, so when a connection becomes
+// readable we must drain it until the kernel says EAGAIN. Complete
+// lines are split out of the player's read buffer and handed to
+// docommand(), exactly like the old per-thread getline() loop did. The
+// reactor also finishes writing a player's outbound queue whenever a
+// socket that had filled up becomes writable again.
+
+// Announcements and messages to other players are written at the end of
+// each batch of events, so one batch's worth goes to each player in a
+// single write. In tick mode (reactor_configure) they are held for a
+// whole tick instead -- a fixed 10-50 ms, say -- which in a crowded room
+// turns many small writes and packets per player into one per tick, at
+// the cost of up to a tick's delay.
+
+// There are two backends, picked at startup (reactor_configure). The
+// epoll one is described above. The io_uring one (see uring.c) does the
+// same work with fewer system calls: one multishot accept per listener
+// and one multishot receive per connection stay armed for good, reads
+// land in a ring of buffers the kernel picks from, and a player's queued
+// output goes out as a chain of linked sends, submitted together with
+// everything else in the reactor's one io_uring_enter per loop. Other
+// threads still write to a player directly when they can (outq_flush),
+// so a multishot poll stands in for epoll's writability events. If the
+// kernel won't run io_uring, the reactor falls back to epoll.
+
+// Rooms have owners. With several reactors, every room but the lobby
+// belongs to one of them (room % nreactors), and a player who moves
+// into a room is handed over to that room's reactor, connection and
+// all, straight after the command that moved it. So everyone in a room
+// is served by the same thread -- optionally pinned to a core of its
+// own (reactor_configure) -- and a room's broadcasts, the queues they
+// fill and the writes that drain them all stay on that core. The lobby
+// has no owner: players stay on the reactor that accepted them until
+// they first leave it, so logins are still spread across every reactor.
+
+// With command workers (see executor.c) the reactors don't run commands
+// at all. They still read, but hand each batch of complete commands to
+// the player's command queue instead of docommand(), and stop reading
+// from a player whose queue is full until a worker wakes them (through
+// the inbox). A player is never closed while a worker may still run its
+// commands, so the reactor waits for that too. Players don't move
+// between reactors then: the rooms are served by whichever worker is
+// free, not by their reactor.
+
+// This gives access to accept4 - saves a system call per connection
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rcu.h"
+#include "metrics.h"
+#include "trace.h"
+#include "player.h"
+#include "pllist.h"
+#include "arena_protocol.h"
+#include "frame.h"
+#include "room.h"
+#include "uring.h"
+#include "executor.h"
+#include "reactor.h"
+
+// Tick length in nanoseconds, or 0 to flush after every batch
+
+static unsigned long tick_ns;
+
+// REACTOR_EPOLL or REACTOR_URING
+
+static int backend = REACTOR_EPOLL;
+
+// Each reactor's inbox, where other reactors hand it the players moving
+// into its rooms -- players (epoll) or connections (io_uring) -- and
+// command workers ask it to look at one of its players again (by
+// handle, since it may have gone by then), and an eventfd to wake it up.
+
+typedef struct {
+    void* conn;          // Handed over, or NULL
+    uint64_t handle;     // Woken by a worker (if conn is NULL)
+} inbox_item;
+
+typedef struct {
+    pthread_mutex_t lock;
+    inbox_item* items;
+    int count;
+    int capacity;
+    int wake_fd;
+} inbox;
+
+static inbox* inboxes;
+static int nreactors = 1;
+static int pin;                // Pin each reactor to a core of its own
+static __thread int self;      // This thread's reactor number
+
+/***********************************************************************
+ * True if the player is in a room owned by another reactor, and should
+ * be handed over to it (never, with command workers).
+ */
+static int misplaced(player_info* player) {
+    return (nreactors > 1) && (executor_workers() == 0) &&
+           (player->in_room != ROOM_LOBBY) &&
+           (player->in_room % nreactors != self);
+}
+
+/***********************************************************************
+ * True once the player has left, and its connection can be closed. With
+ * command workers, its state belongs to them, so ask the executor.
+ */
+static int player_done(player_info* player) {
+    if (executor_workers() > 0)
+        return executor_finished(player);
+    return player->state == PLAYER_DONE;
+}
+
+/***********************************************************************
+ * Put an item in reactor "id"'s inbox, and wake it up.
+ */
+static void post(int id, void* conn, uint64_t handle) {
+    inbox* in = &inboxes[id];
+    pthread_mutex_lock(&in->lock);
+    if (in->count == in->capacity) {
+        in->capacity = (in->capacity > 0) ? in->capacity * 2 : 16;
+        if ((in->items = realloc(in->items, in->capacity * sizeof(inbox_item))) == NULL) {
+            perror("post");
+            exit(1);
+        }
+    }
+    in->items[in->count].conn = conn;
+    in->items[in->count].handle = handle;
+    in->count++;
+    pthread_mutex_unlock(&in->lock);
+
+    uint64_t one = 1;
+    if (write(in->wake_fd, &one, sizeof(one)) < 0)
+        perror("post wake");
+}
+
+/***********************************************************************
+ * Hand a player (or its connection) to the reactor that owns its room.
+ */
+static void hand_over(player_info* player, void* conn) {
+    player->reactor = player->in_room % nreactors;
+    post(player->reactor, conn, 0);
+    metrics_count(METRIC_MIGRATIONS, 1);
+}
+
+/***********************************************************************
+ * reactor_wake asks the reactor serving a player to look at it again:
+ * to read from it again, or to close it. Called by command workers.
+ */
+void reactor_wake(player_info* player) {
+    post(player->reactor, NULL, player->handle);
+}
+
+/***********************************************************************
+ * Take everything handed to this reactor, once its eventfd fires: the
+ * items are copied to "*items" (grown as needed, "*cap" long). Returns
+ * how many there are.
+ */
+static int take_inbox(inbox_item** items, int* cap) {
+    inbox* in = &inboxes[self];
+    uint64_t n;
+    if ((read(in->wake_fd, &n, sizeof(n)) < 0) && (errno != EAGAIN))
+        perror("take_inbox");
+
+    pthread_mutex_lock(&in->lock);
+    int count = in->count;
+    if (count > *cap) {
+        *cap = in->capacity;
+        if ((*items = realloc(*items, *cap * sizeof(inbox_item))) == NULL) {
+            perror("take_inbox");
+            exit(1);
+        }
+    }
+    memcpy(*items, in->items, count * sizeof(inbox_item));
+    in->count = 0;
+    pthread_mutex_unlock(&in->lock);
+    return count;
+}
+
+/***********************************************************************
+ * Pin the calling thread to the self'th of the CPUs we may run on.
+ */
+static void pin_thread(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    int ncpus = CPU_COUNT(&allowed);
+    for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || (seen++ != self % ncpus))
+            continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+        return;
+    }
+}
+
+/***********************************************************************
+ * Unregister a connection from this reactor, and then remove the player
+ * from the player list (which frees all resources, including the
+ * socket). Other threads may still be sending to the player until the
+ * RCU grace period ends, so the socket is shut down right away but only
+ * closed when the player is freed.
+ */
+static void close_player(int epfd, player_info* player) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, player->fd, NULL);
+    shutdown(player->fd, SHUT_RDWR);
+    printf("Client %d disconnected.\n", player->fd);
+    metrics_count(METRIC_DISCONNECTS, 1);
+    pllist_remove(player);
+}
+
+/***********************************************************************
+ * Accept all pending connections on the (non-blocking) listener. Each
+ * new connection gets a player struct and is added to this reactor's
+ * epoll set.
+ */
+static void accept_all(int epfd, int listen_fd) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        TRACE_START(trace_start);
+        int comm_fd = accept4(listen_fd, (struct sockaddr*)&client_addr,
+                              &client_addr_len, SOCK_CLOEXEC);
+        if (comm_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                perror("accept");
+            return;
+        }
+
+        player_info* new_client = new_player(comm_fd);
+        if (new_client == NULL) {
+            close(comm_fd);
+            continue;
+        }
+        new_client->reactor = self;
+        pllist_add(new_client);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = new_client;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, comm_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            pllist_remove(new_client);
+            continue;
+        }
+        metrics_count(METRIC_CONNECTS, 1);
+        TRACE_END(trace_start, TRACE_ACCEPT, comm_fd);
+
+        char addrbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &((struct sockaddr_in*)&client_addr)->sin_addr,
+                  addrbuf, sizeof(addrbuf));
+        printf("Got connection from %s (client %d)\n", addrbuf, comm_fd);
+    }
+}
+
+/***********************************************************************
+ * Run docommand() on every complete line in the player's read buffer,
+ * then shift any partial line down to the start of the buffer.
+ *
+ * Commands are run in place: docommand() gets a pointer into the buffer
+ * and the length of the line, so a client that pipelines
+ * many commands into one packet costs one read and no copying. Only the
+ * bytes that arrived since the last call are searched for newlines, so a
+ * line that trickles in is never rescanned. A line too long for the
+ * buffer is answered with an error and skipped up to its newline.
+ *
+ * If the responses pile up faster than the client reads them, we stop
+ * and leave the rest of the input where it is ("rstalled") until the
+ * socket drains, rather than letting the client overflow its own queue.
+ * We also stop after a command that moves the player into another
+ * reactor's room, and leave the rest to that reactor.
+ */
+static void process_lines(player_info* player) {
+    char* start = player->rbuf;
+    char* scan = player->rbuf + player->rscan;
+    char* end = player->rbuf + player->rlen;
+    char* nl;
+
+    while ((player->state != PLAYER_DONE) &&
+           ((nl = memchr(scan, '\n', end - scan)) != NULL)) {
+        if (player_backlogged(player)) {
+            player_flush(player);
+            if (player_backlogged(player)) {
+                player->rstalled = 1;
+                break;
+            }
+        }
+
+        if (player->rdiscard) {
+            player->rdiscard = 0;  // End of an overlong line
+        } else {
+            docommand(player, start, nl - start);
+        }
+        start = scan = nl + 1;
+
+        if (misplaced(player)) {
+            player->rstalled = 1;  // The new room's reactor carries on
+            break;
+        }
+    }
+
+    // Keep the partial line (usually there isn't one, so no copy)
+    player->rlen = end - start;
+    if ((player->rlen > 0) && (start != player->rbuf))
+        memmove(player->rbuf, start, player->rlen);
+    player->rscan = player->rstalled ? 0 : player->rlen;
+
+    if ((player->rlen == PLAYER_RBUFSIZE) && !player->rstalled) {
+        // No newline in a full buffer -- throw the line away (a stalled
+        // player's full buffer may just be lines it hasn't got to yet)
+        if (!player->rdiscard)
+            player_send(player, "ERR Line too long\n");
+        player->rdiscard = 1;
+        player->rlen = 0;
+        player->rscan = 0;
+    }
+}
+
+/***********************************************************************
+ * Run doframe() on every complete frame in the player's read buffer,
+ * then shift any partial frame down to the start of the buffer. The
+ * binary counterpart of process_lines: the length prefix says where each
+ * frame ends, so nothing is scanned. A frame too big for the buffer
+ * can't be read or skipped reliably, so it ends the connection.
+ */
+static void process_frames(player_info* player) {
+    char* start = player->rbuf;
+    char* end = player->rbuf + player->rlen;
+
+    while ((player->state != PLAYER_DONE) && (end - start >= FRAME_HDRSIZE)) {
+        size_t len = frame_get_u32(start);
+        if (len > PLAYER_RBUFSIZE - FRAME_HDRSIZE) {
+            protocol_abort(player, "Frame too long");
+            break;
+        }
+        if (end - start < FRAME_HDRSIZE + len)
+            break;  // Not all here yet
+
+        if (player_backlogged(player)) {
+            player_flush(player);
+            if (player_backlogged(player)) {
+                player->rstalled = 1;
+                break;
+            }
+        }
+
+        doframe(player, (unsigned char)start[4], start + FRAME_HDRSIZE, len);
+        start += FRAME_HDRSIZE + len;
+
+        if (misplaced(player)) {
+            player->rstalled = 1;  // The new room's reactor carries on
+            break;
+        }
+    }
+
+    player->rlen = end - start;
+    if ((player->rlen > 0) && (start != player->rbuf))
+        memmove(player->rbuf, start, player->rlen);
+}
+
+/***********************************************************************
+ * With command workers, the counterpart of process_lines: hand every
+ * complete line in the player's read buffer to the executor in one
+ * piece, then shift any partial line down. Only the new bytes are
+ * scanned, and only for the last newline. If that fills the player's
+ * command queue, input stops ("rstalled") until a worker takes it.
+ */
+static void queue_lines(player_info* player) {
+    char* start = player->rbuf;
+    char* scan = player->rbuf + player->rscan;
+    char* end = player->rbuf + player->rlen;
+
+    if (player->rdiscard) {
+        char* nl = memchr(scan, '\n', end - scan);
+        if (nl == NULL) {
+            player->rlen = 0;  // Still in the overlong line
+            player->rscan = 0;
+            return;
+        }
+        player->rdiscard = 0;
+        start = scan = nl + 1;
+    }
+
+    char* last = memrchr(scan, '\n', end - scan);
+    if (last != NULL) {
+        if (executor_submit(player, CMD_TEXT, start, last + 1 - start))
+            player->rstalled = 1;
+        start = last + 1;
+    }
+
+    player->rlen = end - start;
+    if ((player->rlen > 0) && (start != player->rbuf))
+        memmove(player->rbuf, start, player->rlen);
+    player->rscan = player->rlen;
+
+    if (player->rlen == PLAYER_RBUFSIZE) {
+        // No newline in a full buffer -- a worker answers with the error
+        executor_submit(player, CMD_TOOLONG, player->rbuf, 0);
+        player->rdiscard = 1;
+        player->rlen = 0;
+        player->rscan = 0;
+    }
+}
+
+/***********************************************************************
+ * With command workers, the counterpart of process_frames: hand every
+ * complete frame in the player's read buffer to the executor in one
+ * piece. A frame too big for the buffer ends the connection, once the
+ * frames before it have run, and the rest of the input is ignored.
+ */
+static void queue_frames(player_info* player) {
+    char* start = player->rbuf;
+    char* p = player->rbuf;
+    char* end = player->rbuf + player->rlen;
+
+    if (player->rdiscard) {
+        player->rlen = 0;
+        return;
+    }
+
+    while (end - p >= FRAME_HDRSIZE) {
+        size_t len = frame_get_u32(p);
+        if (len > PLAYER_RBUFSIZE - FRAME_HDRSIZE) {
+            if (p > start)
+                executor_submit(player, CMD_FRAMES, start, p - start);
+            executor_submit(player, CMD_ABORT, p, 0);
+            player->rdiscard = 1;
+            player->rlen = 0;
+            return;
+        }
+        if (end - p < FRAME_HDRSIZE + len)
+            break;  // Not all here yet
+        p += FRAME_HDRSIZE + len;
+    }
+
+    if ((p > start) && executor_submit(player, CMD_FRAMES, start, p - start))
+        player->rstalled = 1;
+    player->rlen = end - p;
+    if ((player->rlen > 0) && (p != player->rbuf))
+        memmove(player->rbuf, p, player->rlen);
+}
+
+/***********************************************************************
+ * Process whatever complete commands are in the player's read buffer,
+ * in the protocol it speaks (or queue them for a command worker). The
+ * first byte a client sends decides that: the binary protocol's magic
+ * byte (which is then dropped), or anything else for text.
+ */
+static void process_input(player_info* player) {
+    if ((player->proto == PLAYER_UNDECIDED) && (player->rlen > 0)) {
+        if ((unsigned char)player->rbuf[0] == FRAME_MAGIC) {
+            player->proto = PLAYER_BINARY;
+            player->rlen--;
+            memmove(player->rbuf, player->rbuf + 1, player->rlen);
+        } else {
+            player->proto = PLAYER_TEXT;
+        }
+    }
+
+    if (executor_workers() > 0) {
+        if (player->proto == PLAYER_BINARY)
+            queue_frames(player);
+        else
+            queue_lines(player);
+    } else if (player->proto == PLAYER_BINARY) {
+        process_frames(player);
+    } else {
+        process_lines(player);
+    }
+}
+
+/***********************************************************************
+ * Handle a readable connection: read until the socket is drained,
+ * processing commands as they come in. Returns 0 if the connection
+ * should be closed (client disconnected, error, or BYE), 1 otherwise.
+ *
+ * A read that doesn't fill the space we offered has emptied the socket,
+ * so there is no need for another recv() just to be told EAGAIN -- new
+ * data will raise a new edge. The exception is when "drain" is set,
+ * because the edge has already been used up: the peer hung up (and we
+ * must read on until the end of file), or we are resuming a stalled
+ * player.
+ */
+static int handle_input(player_info* player, int drain) {
+    while (!player_done(player) && !player->rstalled) {
+        size_t space = PLAYER_RBUFSIZE - player->rlen;
+
+        TRACE_START(trace_start);
+        ssize_t n = recv(player->fd, player->rbuf + player->rlen, space,
+                         MSG_DONTWAIT);
+        TRACE_END(trace_start, TRACE_RECV, n);
+        if (n > 0) {
+            metrics_count(METRIC_READS, 1);
+            metrics_count(METRIC_BYTES_IN, n);
+            player->rlen += n;
+            process_input(player);
+            if (((size_t)n < space) && !drain)
+                break;  // Drained -- wait for the next edge
+        } else if (n == 0) {
+            return 0;  // Orderly shutdown by the client
+        } else if (errno == EINTR) {
+            continue;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            break;  // Drained -- wait for the next edge
+        } else {
+            return 0;
+        }
+    }
+
+    return !player_done(player);
+}
+
+/***********************************************************************
+ * Handle a batch of input for a player: either new data ("drain" set if
+ * the peer hung up), or resuming a player whose input was stalled once
+ * its output has drained. Returns 0 if the connection should be closed.
+ */
+static int player_input(player_info* player, int drain) {
+    // All responses to this batch of commands go out in one write when
+    // the player is uncorked (before any close). Workers do their own
+    // corking.
+    int workers = executor_workers();
+    if (!workers)
+        player_cork(player);
+    if (player->rstalled) {
+        player->rstalled = 0;
+        process_input(player);
+        drain = 1;
+    }
+    int keep = handle_input(player, drain);
+    if (!workers)
+        player_uncork(player);
+    return keep;
+}
+
+/***********************************************************************
+ * After handling a player's events: close its connection if it is done
+ * ("keep" false), or hand it over if it has moved into another
+ * reactor's room. If a command worker still has commands of the
+ * player's to run, the connection stays open (and its output keeps
+ * flowing) until the worker wakes us.
+ */
+static void settle_player(int epfd, player_info* player, int keep) {
+    if (!keep) {
+        if (executor_quiesce(player))
+            close_player(epfd, player);
+    } else if (misplaced(player)) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, player->fd, NULL);
+        hand_over(player, player);
+    }
+}
+
+/***********************************************************************
+ * Take in the players other reactors have handed over, and carry on
+ * with the input they had left. Players woken by a command worker (if
+ * they are still here) carry on reading, or are closed if they are done.
+ */
+static void adopt_players(int epfd) {
+    static __thread inbox_item* items;
+    static __thread int cap;
+    int n = take_inbox(&items, &cap);
+    for (int i = 0; i < n; i++) {
+        player_info* player = items[i].conn;
+        if (player == NULL) {
+            if ((player = pllist_get(items[i].handle)) != NULL)
+                settle_player(epfd, player,
+                              !player_done(player) && player_input(player, 1));
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = player;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, player->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close_player(epfd, player);
+            continue;
+        }
+        settle_player(epfd, player, player_input(player, 1));
+    }
+}
+
+/***********************************************************************
+ * reactor_configure sets up for "count" reactors (numbered from 0),
+ * pinned to cores if "pin_cores" is set. It turns on tick mode, with a
+ * tick of "tick_ms" milliseconds (0 turns it off), and picks the
+ * backend: REACTOR_EPOLL, or REACTOR_URING if this kernel supports
+ * everything it needs. Returns the backend the reactors will use. Must
+ * be called before any reactor starts.
+ */
+int reactor_configure(int count, int pin_cores, int tick_ms,
+                      int want_backend) {
+    nreactors = count;
+    pin = pin_cores;
+    if ((inboxes = calloc(count, sizeof(inbox))) == NULL) {
+        perror("reactor_configure");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&inboxes[i].lock, NULL);
+        inboxes[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (inboxes[i].wake_fd < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+    }
+
+    tick_ns = tick_ms * 1000000UL;
+    backend = want_backend;
+    if ((backend == REACTOR_URING) && !uring_probe())
+        backend = REACTOR_EPOLL;
+    return backend;
+}
+
+/***********************************************************************
+ * How long epoll_wait may block (in ms, -1 for ever) before the tick at
+ * "next_tick" is due.
+ */
+static int wait_timeout(unsigned long next_tick) {
+    if (tick_ns == 0)
+        return -1;
+    unsigned long now = metrics_now();
+    if (now >= next_tick)
+        return 0;
+    return (next_tick - now + 999999) / 1000000;
+}
+
+/***********************************************************************
+ * End a batch of events: write everything queued for other players
+ * during this batch (or tick, once it is due). Players are only flushed
+ * by handle, so the pending ones can safely wait across quiescent
+ * states.
+ */
+static void end_batch(unsigned long* next_tick) {
+    if (tick_ns == 0) {
+        pllist_flush_pending();
+    } else if (metrics_now() >= *next_tick) {
+        pllist_flush_pending();
+        *next_tick += tick_ns;
+        if (*next_tick < metrics_now())
+            *next_tick = metrics_now() + tick_ns;  // Fell behind
+    }
+}
+
+// The io_uring backend. Each request's user_data is the connection it
+// belongs to (NULL for the listener and the inbox), with the kind of
+// request in the low bits.
+
+#define UOP_ACCEPT 0
+#define UOP_RECV 1
+#define UOP_POLL 2
+#define UOP_SEND 3
+#define UOP_CANCEL 4
+#define UOP_WAKE 5
+#define UOP_MASK 7
+
+// One io_uring reactor
+
+typedef struct {
+    uring ring;
+    uring_bufs bufs;     // Where multishot receives put their data
+    int listen_fd;
+} ureactor;
+
+// A connection, as seen by its io_uring reactor. It outlives the
+// requests it has in flight, so the player is only removed (and its
+// socket closed), or handed over to another reactor, once the last of
+// them has completed.
+
+typedef struct {
+    player_info* player;
+    int fd;
+    int nops;            // Requests in flight (a multishot counts once)
+    int recv_armed;      // The multishot receive is in flight
+    int recv_cancelled;  // ...but has been asked to stop
+    int poll_armed;      // The multishot poll is in flight
+    int nsends;          // Linked sends in flight
+    int send_failed;     // One of them failed
+    int closing;         // Shut down, waiting for requests to finish
+    int moving;          // Waiting for requests to finish, to hand over
+    int eof;             // The client is done sending
+    char* spill;         // Input received while the player was stalled
+    size_t spill_len;
+    size_t spill_off;    // Bytes of spill already processed
+    size_t spill_cap;
+    struct msghdr mh[REACTOR_URING_LINKS];
+    struct iovec iov[REACTOR_URING_LINKS * OUTQ_MAXIOV];
+} uconn;
+
+/***********************************************************************
+ * Arm the multishot accept on the listener.
+ */
+static void arm_accept(ureactor* u) {
+    struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UOP_ACCEPT;
+}
+
+/***********************************************************************
+ * Arm a connection's multishot receive, which reads into whichever
+ * provided buffer the kernel picks, for as long as there is input.
+ */
+static void arm_recv(ureactor* u, uconn* c) {
+    struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = u->bufs.bgid;
+    sqe->user_data = (unsigned long)c | UOP_RECV;
+    c->recv_armed = 1;
+    c->recv_cancelled = 0;
+    c->nops++;
+}
+
+/***********************************************************************
+ * Arm a connection's multishot poll for writability, which tells us
+ * when a socket that another thread filled up has room again.
+ */
+static void arm_poll(ureactor* u, uconn* c) {
+    struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (unsigned long)c | UOP_POLL;
+    c->poll_armed = 1;
+    c->nops++;
+}
+
+/***********************************************************************
+ * Arm a multishot poll on the inbox's eventfd, which fires when another
+ * reactor hands us a connection.
+ */
+static void arm_wake(ureactor* u) {
+    struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = inboxes[self].wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UOP_WAKE;
+}
+
+/***********************************************************************
+ * Cancel a connection's request of kind "op" (UOP_RECV or UOP_POLL), or
+ * everything it has in flight ("op" -1). The cancelled requests
+ * complete with -ECANCELED.
+ */
+static void cancel(ureactor* u, uconn* c, int op) {
+    struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (op < 0) {
+        sqe->fd = c->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else {
+        sqe->addr = (unsigned long)c | op;
+    }
+    sqe->user_data = UOP_CANCEL;
+}
+
+/***********************************************************************
+ * Send whatever is queued for the player, as a chain of linked sends of
+ * up to OUTQ_MAXIOV messages each. The link makes the kernel run them
+ * in order, one after the other, and MSG_WAITALL makes each finish
+ * (waiting for the socket to drain if need be) before the next starts,
+ * so the chain writes the queue as one stream. Nothing new is sent
+ * until the whole chain has completed.
+ */
+static void send_queue(ureactor* u, uconn* c) {
+    if (c->closing)
+        return;
+    int n = outq_claim(&c->player->out, c->iov,
+                       REACTOR_URING_LINKS * OUTQ_MAXIOV);
+    if (n == 0)
+        return;
+
+    uring_reserve(&u->ring, (n + OUTQ_MAXIOV - 1) / OUTQ_MAXIOV);
+    for (int i = 0, k = 0; i < n; i += OUTQ_MAXIOV, k++) {
+        struct msghdr* mh = &c->mh[k];
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_iov = c->iov + i;
+        mh->msg_iovlen = (n - i < OUTQ_MAXIOV) ? n - i : OUTQ_MAXIOV;
+
+        struct io_uring_sqe* sqe = uring_sqe(&u->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long)mh;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (i + OUTQ_MAXIOV < n)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long)c | UOP_SEND;
+        c->nsends++;
+        c->nops++;
+    }
+}
+
+/***********************************************************************
+ * Start closing a connection: shut the socket down and cancel whatever
+ * it has in flight. The player is removed once all of that completes
+ * (finish_close).
+ */
+static void begin_close(ureactor* u, uconn* c) {
+    if (c->closing)
+        return;
+    c->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+    if (c->nops > 0)
+        cancel(u, c, -1);
+}
+
+/***********************************************************************
+ * Start handing a connection over to the reactor that owns its player's
+ * new room: stop its receive and poll, and let any sends finish. The
+ * player's input is stalled meanwhile, so whatever else arrives is
+ * spilled, and goes over with it.
+ */
+static void begin_move(ureactor* u, uconn* c) {
+    if (c->moving)
+        return;
+    c->moving = 1;
+    if (c->recv_armed && !c->recv_cancelled) {
+        cancel(u, c, UOP_RECV);
+        c->recv_cancelled = 1;
+    }
+    if (c->poll_armed)
+        cancel(u, c, UOP_POLL);
+}
+
+/***********************************************************************
+ * Start closing a connection whose client has finished with it, as soon
+ * as no command worker has any of its commands left to run (they are
+ * run, and answered, first -- the worker wakes us when they are done).
+ */
+static void close_when_idle(ureactor* u, uconn* c) {
+    if (executor_quiesce(c->player))
+        begin_close(u, c);
+}
+
+/***********************************************************************
+ * Finish closing a connection, once it has nothing left in flight:
+ * remove the player from the player list (which frees everything,
+ * socket included, after the RCU grace period) and free the connection.
+ */
+static void finish_close(uconn* c) {
+    printf("Client %d disconnected.\n", c->fd);
+    metrics_count(METRIC_DISCONNECTS, 1);
+    pllist_remove(c->player);
+    free(c->spill);
+    free(c);
+}
+
+/***********************************************************************
+ * Copy as much of "data" into the player's read buffer as it will take
+ * and process it, until it has all been used, the player stalls, or it
+ * leaves. Returns the number of bytes used.
+ */
+static size_t consume(player_info* player, const char* data, size_t len) {
+    size_t used = 0;
+    while ((used < len) && !player->rstalled && !player_done(player)) {
+        size_t n = len - used;
+        if (n > PLAYER_RBUFSIZE - player->rlen)
+            n = PLAYER_RBUFSIZE - player->rlen;
+        memcpy(player->rbuf + player->rlen, data + used, n);
+        player->rlen += n;
+        used += n;
+        process_input(player);
+    }
+    return used;
+}
+
+/***********************************************************************
+ * Keep input that arrived while the player was stalled, until it
+ * resumes.
+ */
+static void spill(uconn* c, const char* data, size_t len) {
+    if (c->spill_off == c->spill_len)
+        c->spill_off = c->spill_len = 0;
+    if (c->spill_len + len > c->spill_cap) {
+        size_t cap = (c->spill_cap > 0) ? c->spill_cap : PLAYER_RBUFSIZE;
+        while (cap < c->spill_len + len)
+            cap *= 2;
+        if ((c->spill = realloc(c->spill, cap)) == NULL) {
+            perror("spill");
+            exit(1);
+        }
+        c->spill_cap = cap;
+    }
+    memcpy(c->spill + c->spill_len, data, len);
+    c->spill_len += len;
+}
+
+/***********************************************************************
+ * After a batch of input for a player: hand it over if it has moved
+ * into another reactor's room, or else send its responses, and either
+ * start closing it (if it has left, and they have all gone), stop its
+ * receive (if it stalled, so the kernel's socket buffer pushes back on
+ * the client, as with epoll), start closing it (if the client has
+ * finished sending, and all its input has been used), or make sure the
+ * receive is armed (if it may have ended).
+ */
+static void input_done(ureactor* u, uconn* c) {
+    player_info* player = c->player;
+    if (c->moving)
+        return;
+    if (misplaced(player) && (player->state != PLAYER_DONE)) {
+        begin_move(u, c);  // The new reactor sends its responses
+        return;
+    }
+    send_queue(u, c);
+    if (c->closing)
+        return;
+    if (player_done(player)) {
+        // Once the last of its output (the answer to BYE) is sent
+        if (c->nsends == 0)
+            close_when_idle(u, c);
+    } else if (player->rstalled) {
+        if (c->recv_armed && !c->recv_cancelled) {
+            cancel(u, c, UOP_RECV);
+            c->recv_cancelled = 1;
+        }
+    } else if (c->eof) {
+        if (c->nsends == 0)
+            close_when_idle(u, c);
+    } else if (!c->recv_armed) {
+        arm_recv(u, c);
+    }
+}
+
+/***********************************************************************
+ * Resume a stalled player once its output has drained (or, with command
+ * workers, once there is room in its command queue): first the input
+ * left in its read buffer, then anything that arrived meanwhile. A
+ * worker waiting for the output to drain is told too.
+ */
+static void resume_input(ureactor* u, uconn* c) {
+    player_info* player = c->player;
+    int workers = executor_workers();
+    if (workers && !c->closing)
+        executor_resume(player);
+    if (c->closing || !player->rstalled ||
+        (workers ? executor_paused(player) : player_backlogged(player)))
+        return;
+
+    if (!workers)
+        player_cork(player);
+    player->rstalled = 0;
+    process_input(player);
+    c->spill_off += consume(player, c->spill + c->spill_off,
+                            c->spill_len - c->spill_off);
+    if (!workers)
+        player_uncork_noflush(player);
+    input_done(u, c);
+}
+
+/***********************************************************************
+ * Set up a connection accepted by the multishot accept.
+ */
+static void new_connection(ureactor* u, int comm_fd) {
+    TRACE_START(trace_start);
+    player_info* new_client = new_player(comm_fd);
+    if (new_client == NULL) {
+        close(comm_fd);
+        return;
+    }
+    pllist_add(new_client);
+
+    uconn* c = calloc(1, sizeof(uconn));
+    if (c == NULL) {
+        perror("new_connection");
+        exit(1);
+    }
+    c->player = new_client;
+    c->fd = comm_fd;
+    new_client->reactor = self;
+    new_client->conn = c;
+    arm_recv(u, c);
+    arm_poll(u, c);
+    metrics_count(METRIC_CONNECTS, 1);
+    TRACE_END(trace_start, TRACE_ACCEPT, comm_fd);
+
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    char addrbuf[INET_ADDRSTRLEN] = "?";
+    if (getpeername(comm_fd, (struct sockaddr*)&client_addr,
+                    &client_addr_len) == 0)
+        inet_ntop(AF_INET, &((struct sockaddr_in*)&client_addr)->sin_addr,
+                  addrbuf, sizeof(addrbuf));
+    printf("Got connection from %s (client %d)\n", addrbuf, comm_fd);
+}
+
+/***********************************************************************
+ * Handle a completion of a connection's multishot receive: "res" bytes
+ * of input in the buffer named in "flags", the end of the input (0), or
+ * an error. Running out of buffers (-ENOBUFS) or being cancelled ends
+ * the receive, but not the connection.
+ */
+static void on_recv(ureactor* u, uconn* c, int res, unsigned flags) {
+    player_info* player = c->player;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->nops--;
+    }
+
+    if (res > 0) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char* data = uring_buf(&u->bufs, bid);
+        metrics_count(METRIC_READS, 1);
+        metrics_count(METRIC_BYTES_IN, res);
+        if (!c->closing) {
+            // Like the epoll reactor, write all responses to this batch of
+            // commands together
+            int workers = executor_workers();
+            if (!workers)
+                player_cork(player);
+            size_t used = 0;
+            if (c->spill_off == c->spill_len)
+                used = consume(player, data, res);
+            if ((used < (size_t)res) && !player_done(player))
+                spill(c, data + used, res - used);
+            if (!workers)
+                player_uncork_noflush(player);
+        }
+        uring_buf_recycle(&u->bufs, bid);
+    }
+
+    if (c->closing)
+        return;
+    if ((res < 0) && (res != -ENOBUFS) && (res != -ECANCELED)) {
+        begin_close(u, c);
+    } else {
+        if (res == 0)
+            c->eof = 1;  // Closed once the input before it has been used
+        input_done(u, c);
+    }
+}
+
+/***********************************************************************
+ * Handle a completion of one of a connection's linked sends. Once the
+ * whole chain is done, send whatever was queued meanwhile, and resume
+ * the player if it was waiting for its output to drain.
+ */
+static void on_send(ureactor* u, uconn* c, int res) {
+    c->nsends--;
+    c->nops--;
+    if (res > 0)
+        outq_sent(&c->player->out, res);
+    if (res < 0)
+        c->send_failed = 1;
+    if (c->nsends > 0)
+        return;
+
+    int more = outq_unclaim(&c->player->out, !c->send_failed);
+    c->send_failed = 0;
+    if (more < 0) {
+        begin_close(u, c);
+    } else if (!c->closing && !c->moving) {
+        if (more)
+            send_queue(u, c);
+        if (player_done(c->player) ||
+            (c->eof && !c->player->rstalled)) {
+            if (c->nsends == 0)
+                close_when_idle(u, c);
+        } else {
+            resume_input(u, c);
+        }
+    }
+}
+
+/***********************************************************************
+ * Once a connection that is closing or moving has nothing left in
+ * flight, finish closing it (when no command worker is about to run one
+ * of its commands either) or hand it over.
+ */
+static void settle_connection(uconn* c) {
+    if (c->nops > 0)
+        return;
+    if (c->closing) {
+        if (executor_quiesce(c->player))
+            finish_close(c);
+    } else if (c->moving) {
+        hand_over(c->player, c);
+    }
+}
+
+/***********************************************************************
+ * Look at a connection again when a command worker asks us to: carry on
+ * reading from it, or close it if its client has gone or its player has
+ * left (and the worker is done with it).
+ */
+static void wake_connection(ureactor* u, uconn* c) {
+    if (c->closing)
+        return;
+    if (c->player->rstalled && !player_done(c->player))
+        resume_input(u, c);
+    else
+        input_done(u, c);
+}
+
+/***********************************************************************
+ * Take in the connections other reactors have handed over: arm them
+ * here, send what is queued for their players, and carry on with the
+ * input they had left. Connections woken by a command worker (if they
+ * are still here) are looked at again.
+ */
+static void adopt_connections(ureactor* u) {
+    static __thread inbox_item* items;
+    static __thread int cap;
+    int n = take_inbox(&items, &cap);
+    for (int i = 0; i < n; i++) {
+        uconn* c = items[i].conn;
+        if (c == NULL) {
+            player_info* player = pllist_get(items[i].handle);
+            if (player != NULL) {
+                c = player->conn;
+                wake_connection(u, c);
+                settle_connection(c);
+            }
+            continue;
+        }
+
+        c->moving = 0;
+        arm_poll(u, c);
+        send_queue(u, c);
+        resume_input(u, c);
+        if (!c->moving && !c->recv_armed && !c->player->rstalled)
+            arm_recv(u, c);
+    }
+}
+
+/***********************************************************************
+ * Handle one completion.
+ */
+static void on_completion(ureactor* u, unsigned long user_data, int res,
+                          unsigned flags) {
+    uconn* c = (uconn*)(user_data & ~(unsigned long)UOP_MASK);
+    switch (user_data & UOP_MASK) {
+    case UOP_ACCEPT:
+        if (res >= 0)
+            new_connection(u, res);
+        else if (res != -ECANCELED)
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        if (!(flags & IORING_CQE_F_MORE))
+            arm_accept(u);
+        return;
+    case UOP_RECV:
+        on_recv(u, c, res, flags);
+        break;
+    case UOP_POLL:
+        if (!(flags & IORING_CQE_F_MORE)) {
+            c->poll_armed = 0;
+            c->nops--;
+        }
+        if (c->closing || c->moving)
+            break;
+        if (res > 0) {
+            send_queue(u, c);
+            resume_input(u, c);
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+            arm_poll(u, c);
+        break;
+    case UOP_SEND:
+        on_send(u, c, res);
+        break;
+    case UOP_WAKE:
+        adopt_connections(u);
+        if (!(flags & IORING_CQE_F_MORE))
+            arm_wake(u);
+        return;
+    default:
+        return;  // A cancellation's own completion
+    }
+    settle_connection(c);
+}
+
+/***********************************************************************
+ * The io_uring event loop, the counterpart of the epoll loop in
+ * reactor_run (and an RCU quiescent state per trip around it, the same
+ * way). Returns false straight away if the ring can't be set up, or true
+ * if io_uring_enter fails after that.
+ */
+static int uring_run(int listen_fd) {
+    ureactor u;
+    if (!uring_init(&u.ring, REACTOR_URING_ENTRIES))
+        return 0;
+    if (!uring_bufs_init(&u.ring, &u.bufs, 0, REACTOR_URING_BUFS,
+                         PLAYER_RBUFSIZE)) {
+        uring_destroy(&u.ring);
+        return 0;
+    }
+    u.listen_fd = listen_fd;
+    arm_accept(&u);
+    arm_wake(&u);
+
+    unsigned long next_tick = metrics_now() + tick_ns;
+    while (1) {
+        int timeout = wait_timeout(next_tick);
+        rcu_thread_offline();
+        TRACE_START(trace_start);
+        int ret = uring_enter(&u.ring, 1,
+                              (timeout < 0) ? -1 : timeout * 1000000L);
+        TRACE_END(trace_start, TRACE_EPOLL_WAIT, ret);
+        rcu_thread_online();
+        if ((ret < 0) && (errno != EINTR) && (errno != ETIME) &&
+            (errno != EBUSY)) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        for (int i = 0; (i < REACTOR_MAXEVENTS) &&
+                        ((cqe = uring_peek(&u.ring)) != NULL); i++) {
+            unsigned long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_seen(&u.ring);
+            on_completion(&u, user_data, res, flags);
+        }
+
+        end_batch(&next_tick);
+        rcu_quiescent();
+    }
+
+    uring_destroy(&u.ring);
+    return 1;
+}
+
+/***********************************************************************
+ * The event loop of reactor number "id" (on the configured backend),
+ * pinned to a core if reactor_configure said so. Never returns
+ * unless epoll or io_uring itself fails. The listening socket must
+ * already be in non-blocking mode.
+ *
+ * Each trip around the loop is an RCU quiescent state: pointers to
+ * players and rosters obtained while handling one batch of events are
+ * never kept for the next. While blocked in epoll_wait the thread is
+ * offline, so it never holds up the freeing of old data. (Players being
+ * handed over are the exception, but only a player's own reactor ever
+ * removes it, and while in an inbox it has none.)
+ */
+void reactor_run(int id, int listen_fd) {
+    self = id;
+    if (pin)
+        pin_thread();
+    rcu_register_thread();
+    if (backend == REACTOR_URING) {
+        if (uring_run(listen_fd))
+            return;
+        fprintf(stderr, "Couldn't set up io_uring, using epoll.\n");
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // The listener is the only entry with a NULL data pointer, and the
+    // inbox's eventfd the only one pointing at the inbox
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl listener");
+        exit(1);
+    }
+    ev.data.ptr = &inboxes[self];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, inboxes[self].wake_fd, &ev) < 0) {
+        perror("epoll_ctl inbox");
+        exit(1);
+    }
+
+    struct epoll_event events[REACTOR_MAXEVENTS];
+    unsigned long next_tick = metrics_now() + tick_ns;
+    while (1) {
+        rcu_thread_offline();
+        TRACE_START(trace_start);
+        int nev = epoll_wait(epfd, events, REACTOR_MAXEVENTS,
+                             wait_timeout(next_tick));
+        TRACE_END(trace_start, TRACE_EPOLL_WAIT, nev);
+        rcu_thread_online();
+        if (nev < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nev; i++) {
+            player_info* player = events[i].data.ptr;
+            if (player == NULL) {
+                accept_all(epfd, listen_fd);
+                continue;
+            }
+            if ((void*)player == &inboxes[self]) {
+                adopt_players(epfd);
+                continue;
+            }
+
+            int keep = 1;
+            if (events[i].events & EPOLLOUT) {
+                player_flush(player);
+                if (executor_workers() > 0)
+                    executor_resume(player);
+                else if (player->rstalled && !player_backlogged(player))
+                    keep = player_input(player, 1);
+            }
+            if (keep && (events[i].events & ~EPOLLOUT)) {
+                int hup = events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+                keep = player_input(player, hup);
+            }
+            settle_player(epfd, player, keep);
+        }
+
+        end_batch(&next_tick);
+        rcu_quiescent();
+    }
+
+    close(epfd);
+}
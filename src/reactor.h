@@ -0,0 +1,34 @@
+// Prototypes for the reactor (event loop) module
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include "player.h"
+
+// Maximum number of events handled per epoll_wait call
+
+#define REACTOR_MAXEVENTS 256
+
+// Longest tick allowed in tick mode, in milliseconds
+
+#define REACTOR_MAXTICK 1000
+
+// Backends
+
+#define REACTOR_EPOLL 0
+#define REACTOR_URING 1
+
+// Sizes for the io_uring backend, per reactor: submission queue
+// entries, receive buffers (each PLAYER_RBUFSIZE bytes), and the most
+// linked sends (each of up to OUTQ_MAXIOV messages) per flush
+
+#define REACTOR_URING_ENTRIES 1024
+#define REACTOR_URING_BUFS 256
+#define REACTOR_URING_LINKS 4
+
+int reactor_configure(int count, int pin_cores, int tick_ms,
+                      int want_backend);
+void reactor_run(int id, int listen_fd);
+void reactor_wake(player_info* player);
+
+#endif  // _REACTOR_H
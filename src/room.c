@@ -0,0 +1,357 @@
+// The room registry keeps track of every room and who is in it.
+
+// Rooms are allocated from a fixed pool of slots, so finding a room by
+// id is just an array index, and creating or reclaiming one is a push
+// or pop on a free list -- there is no searching, whether there are
+// five rooms or thousands. The first ROOM_NPERMANENT slots are the lobby
+// and the original four arenas, which always exist. Any other room is
+// reclaimed as soon as the last player leaves it, and its slot goes back
+// on the free list with its generation bumped, so the old id is dead.
+//
+// Each room's members are kept in a roster (an array of the players in
+// the room), so room listings and announcements only have to look at
+// the players in that one room. Rosters are never changed in place:
+// writers build a new copy and publish it with a single pointer store,
+// and the old copy is freed after an RCU grace period (see rcu.c), so
+// readers never take a lock. Every roster records which room it belongs
+// to, so a reader holding a stale id can't mistake the roster of the
+// slot's next room for the one it asked about.
+//
+// Every roster also carries the room's version and a log of the last
+// ROOM_LOGSIZE joins and leaves. Each new copy brings the log forward
+// from the one it replaces, so a reader gets a version, the members and
+// the changes that all agree, from the one snapshot. A client that has
+// listed the room before can then be told just what has changed since.
+//
+// Writers lock only the rooms they change, so players joining and
+// leaving different rooms don't wait for each other. Moving between two
+// rooms takes both locks, lower slot first. The free list has a lock of
+// its own, which is always taken last.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rcu.h"
+#include "history.h"
+#include "metrics.h"
+#include "room.h"
+
+// One slot of the pool
+
+typedef struct {
+    pthread_mutex_t lock;      // Held while changing the room
+    _Atomic(roster*) members;  // Current roster, NULL if nobody is in it
+    int gen;                   // Generation of the room in this slot
+    uint32_t changes;          // Joins and leaves so far (the version)
+    int live;                  // True if the slot holds a room
+    int next_free;             // Next slot on the free list
+} room_slot;
+
+static room_slot slots[ROOM_MAXROOMS];
+static atomic_int nslots;   // Slots ever used; the rest are untouched
+static atomic_int nlive;    // Rooms that currently exist
+
+// The free list, and the lock that protects it (and nslots growing)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_head = -1;  // Most recently reclaimed slot, -1 if none
+
+/***************************************************************************
+ * Split a room id into its generation (the slot number is room_slot_of),
+ * and make one from a slot number and generation.
+ */
+static inline int id_gen(int id) {
+    return (id >> ROOM_SLOTBITS) & ROOM_GENMASK;
+}
+
+static inline int make_id(int slot, int gen) {
+    return (gen << ROOM_SLOTBITS) | slot;
+}
+
+/***************************************************************************
+ * valid_id checks that "id" names a room that exists right now. The
+ * caller holds the room's lock.
+ */
+static int valid_id(int id) {
+    room_slot* s = &slots[room_slot_of(id)];
+    return s->live && (s->gen == id_gen(id));
+}
+
+/***************************************************************************
+ * Initialize a slot that has never been used.
+ */
+static void init_slot(int slot) {
+    pthread_mutex_init(&slots[slot].lock, NULL);
+    atomic_init(&slots[slot].members, NULL);
+    slots[slot].gen = 0;
+    slots[slot].changes = 0;
+    slots[slot].live = 0;
+}
+
+/***************************************************************************
+ * room_init sets up the permanent rooms. Should be called once at the
+ * beginning of main, when the program starts up.
+ */
+void room_init(void) {
+    for (int i = 0; i < ROOM_NPERMANENT; i++) {
+        init_slot(i);
+        slots[i].live = 1;
+    }
+    atomic_store(&nslots, ROOM_NPERMANENT);
+    atomic_store(&nlive, ROOM_NPERMANENT);
+}
+
+/***************************************************************************
+ * room_create makes a new, empty room and returns its id, or -1 if the
+ * pool is full. The caller should move someone into it straight away,
+ * since it is only reclaimed when its last member leaves.
+ */
+int room_create(void) {
+    int slot;
+    metrics_lock(&pool_lock, METRIC_LOCK_ROOM_POOL);
+    if (free_head >= 0) {
+        slot = free_head;
+        free_head = slots[slot].next_free;
+    } else if (atomic_load(&nslots) < ROOM_MAXROOMS) {
+        slot = atomic_load(&nslots);
+        init_slot(slot);
+        atomic_store(&nslots, slot + 1);
+    } else {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // Make sure the room's history gets mapped (it normally already is)
+    history_prepare(slot);
+
+    // Nobody knows the new id yet, but a stale one might be tried
+    metrics_lock(&slots[slot].lock, METRIC_LOCK_ROOM);
+    slots[slot].live = 1;
+    int id = make_id(slot, slots[slot].gen);
+    pthread_mutex_unlock(&slots[slot].lock);
+
+    atomic_fetch_add(&nlive, 1);
+    return id;
+}
+
+/***************************************************************************
+ * Reclaim the (empty) room in "slot", unless it is a permanent room. The
+ * caller holds the room's lock.
+ */
+static void reclaim(int slot) {
+    if (slot < ROOM_NPERMANENT)
+        return;
+    slots[slot].live = 0;
+    slots[slot].gen = (slots[slot].gen + 1) & ROOM_GENMASK;
+    history_forget(slot);
+
+    metrics_lock(&pool_lock, METRIC_LOCK_ROOM_POOL);
+    slots[slot].next_free = free_head;
+    free_head = slot;
+    pthread_mutex_unlock(&pool_lock);
+    atomic_fetch_sub(&nlive, 1);
+}
+
+/***************************************************************************
+ * new_roster allocates a roster for room "id" with room for "count"
+ * members.
+ */
+static roster* new_roster(int id, int count) {
+    roster* r = malloc(sizeof(roster) + count * sizeof(player_info*));
+    if (r == NULL) {
+        perror("room - allocating roster");
+        exit(1);
+    }
+    r->room = id;
+    r->count = count;
+    return r;
+}
+
+/***************************************************************************
+ * log_change records in new roster "r" that "player" joined (or left)
+ * the room in slot "s", after the changes logged in "old" (the roster
+ * it replaces), and gives "r" the room's next version. If the room was
+ * empty ("old" is NULL) there is no earlier roster anyone could have
+ * listed, so the log starts out empty. The caller holds the room's lock.
+ */
+static void log_change(roster* r, roster* old, room_slot* s,
+                       player_info* player, int joined) {
+    r->version = ((uint64_t)r->room << 32) | ++s->changes;
+    r->nlog = 0;
+    if (old == NULL)
+        return;
+
+    int keep = (old->nlog < ROOM_LOGSIZE) ? old->nlog : ROOM_LOGSIZE - 1;
+    memcpy(r->log, old->log + old->nlog - keep, keep * sizeof(roster_change));
+
+    roster_change* c = &r->log[keep];
+    c->handle = player->handle;
+    strcpy(c->name, player->name);
+    c->joined = joined;
+    r->nlog = keep + 1;
+}
+
+/***************************************************************************
+ * room_snapshot returns the current roster of room "id" (NULL if the
+ * room is empty or doesn't exist). It stays valid until the calling
+ * thread's next RCU quiescent state.
+ */
+roster* room_snapshot(int id) {
+    if (id < 0)
+        return NULL;
+    roster* r = atomic_load_explicit(&slots[room_slot_of(id)].members,
+                                     memory_order_acquire);
+    return ((r != NULL) && (r->room == id)) ? r : NULL;
+}
+
+/***************************************************************************
+ * room_changes returns how many of the changes logged in roster "r" came
+ * after "since" (they are the last that many in its log), or -1 if
+ * "since" isn't a version of r's room, or is too old to be in the log.
+ */
+int room_changes(roster* r, uint64_t since) {
+    if ((r == NULL) || ((since >> 32) != (uint32_t)r->room))
+        return -1;
+    uint32_t behind = (uint32_t)r->version - (uint32_t)since;
+    return (behind <= (uint32_t)r->nlog) ? (int)behind : -1;
+}
+
+/***************************************************************************
+ * link_locked adds a player to the roster for its current room, and
+ * unlink_locked takes it out again (reclaiming the room if that empties
+ * it). Each publishes a new copy of the roster (O(room size)). The
+ * caller holds the room's lock.
+ */
+static void link_locked(player_info* player) {
+    if (player->indexed)
+        return;
+
+    int id = player->in_room;
+    room_slot* s = &slots[room_slot_of(id)];
+    roster* old = atomic_load(&s->members);
+    int count = (old == NULL) ? 0 : old->count;
+    roster* r = new_roster(id, count + 1);
+    if (count > 0)
+        memcpy(r->members, old->members, count * sizeof(player_info*));
+    r->members[count] = player;
+    log_change(r, old, s, player, 1);
+
+    atomic_store_explicit(&s->members, r, memory_order_release);
+    if (old != NULL)
+        rcu_retire(old, free);
+    player->indexed = 1;
+}
+
+static void unlink_locked(player_info* player) {
+    if (!player->indexed)
+        return;
+
+    int slot = room_slot_of(player->in_room);
+    room_slot* s = &slots[slot];
+    roster* old = atomic_load(&s->members);
+    roster* r = NULL;
+    if (old->count > 1) {
+        r = new_roster(old->room, old->count - 1);
+        int j = 0;
+        for (int i = 0; i < old->count; i++) {
+            if (old->members[i] != player)
+                r->members[j++] = old->members[i];
+        }
+        log_change(r, old, s, player, 0);
+    } else {
+        s->changes++;
+    }
+
+    atomic_store_explicit(&s->members, r, memory_order_release);
+    rcu_retire(old, free);
+    player->indexed = 0;
+
+    if (r == NULL)
+        reclaim(slot);
+}
+
+/***************************************************************************
+ * room_link adds a player to the roster for its current room (which must
+ * exist, so this is for the lobby), and room_unlink takes it out again.
+ * Only the player's own thread may move it between rooms.
+ */
+void room_link(player_info* player) {
+    room_slot* s = &slots[room_slot_of(player->in_room)];
+    metrics_lock(&s->lock, METRIC_LOCK_ROOM);
+    link_locked(player);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void room_unlink(player_info* player) {
+    room_slot* s = &slots[room_slot_of(player->in_room)];
+    metrics_lock(&s->lock, METRIC_LOCK_ROOM);
+    unlink_locked(player);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/***************************************************************************
+ * room_move moves a registered player from its current room into room
+ * "id". Returns false (and leaves the player where it was) if there is
+ * no such room. Both rooms are locked for the move, lower slot first, so
+ * the player is never seen in neither room or in both.
+ */
+int room_move(player_info* player, int id) {
+    if ((id < 0) || (room_slot_of(id) >= atomic_load(&nslots)))
+        return 0;
+    if (player->indexed && (player->in_room == id))
+        return 1;
+
+    // Only one lock if the player isn't in a room (or it's the same slot,
+    // in which case "id" must be stale -- the player's room is live)
+    int from = room_slot_of(player->in_room);
+    int to = room_slot_of(id);
+    room_slot* first = &slots[to];
+    room_slot* second = NULL;
+    if (player->indexed && (from != to)) {
+        first = &slots[(from < to) ? from : to];
+        second = &slots[(from < to) ? to : from];
+    }
+    metrics_lock(&first->lock, METRIC_LOCK_ROOM);
+    if (second != NULL)
+        metrics_lock(&second->lock, METRIC_LOCK_ROOM);
+
+    int moved = valid_id(id);
+    if (moved) {
+        unlink_locked(player);
+        player->in_room = id;
+        link_locked(player);
+    }
+
+    if (second != NULL)
+        pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+    return moved;
+}
+
+/***************************************************************************
+ * room_count returns the number of rooms that currently exist.
+ */
+int room_count(void) {
+    return atomic_load(&nlive);
+}
+
+/***************************************************************************
+ * room_foreach calls "fn" with the id and population of every permanent
+ * room, and of every other room with players in it. The populations come
+ * from the rosters, so the calling thread must be a registered RCU thread.
+ */
+void room_foreach(void (*fn)(int id, int count, void* arg), void* arg) {
+    int n = atomic_load(&nslots);
+    for (int slot = 0; slot < n; slot++) {
+        roster* r = atomic_load_explicit(&slots[slot].members,
+                                         memory_order_acquire);
+        if (r != NULL)
+            fn(r->room, r->count, arg);
+        else if (slot < ROOM_NPERMANENT)
+            fn(slot, 0, arg);
+    }
+}
@@ -0,0 +1,73 @@
+// Prototypes for the room registry: the lobby, the arenas and their rosters
+
+#ifndef _ROOM_H
+#define _ROOM_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+// Room 0 is the lobby and rooms 1-4 are the original arenas. These
+// always exist; any others are created on demand and go away when the
+// last player leaves.
+
+#define ROOM_LOBBY 0
+#define ROOM_NPERMANENT 5
+
+// Rooms live in a fixed pool of slots. A room id is the slot number plus
+// a generation count in the bits above it, so an id that refers to a
+// room that has since been reclaimed never matches the slot's next room.
+
+#define ROOM_SLOTBITS 16
+#define ROOM_MAXROOMS (1 << ROOM_SLOTBITS)
+#define ROOM_GENMASK 0x7fff
+
+// The slot number of the room with id "id"
+
+static inline int room_slot_of(int id) {
+    return id & (ROOM_MAXROOMS - 1);
+}
+
+// How many of its latest joins and leaves each room remembers, so a
+// client that already has its roster can be sent just the changes
+
+#define ROOM_LOGSIZE 64
+
+// One join or leave. The name is copied, since a player that left may
+// be gone by the time the change is read.
+
+typedef struct {
+    uint64_t handle;          // The player's id
+    char name[PLAYER_MAXNAME+1];
+    char joined;              // True for a join, false for a leave
+} roster_change;
+
+// An immutable snapshot of the registered players in a room, in arrival
+// order, with the changes that led up to it. Replaced, never modified.
+// The version is the room id in the top half and a count of the room's
+// changes in the bottom half, so no two rooms' versions are ever equal.
+
+typedef struct {
+    int room;                 // Id of the room this is the roster of
+    int count;                // Number of members
+    uint64_t version;         // Goes up by one with every change
+    int nlog;                 // How many of the changes are in the log
+    roster_change log[ROOM_LOGSIZE];  // The latest changes, oldest first
+    player_info* members[];
+} roster;
+
+// Lookups are lock-free. Writers lock only the rooms they change. Old
+// rosters are freed through rcu_retire, so readers must be registered
+// RCU threads.
+
+void room_init(void);
+int room_create(void);
+roster* room_snapshot(int id);
+void room_link(player_info* player);
+void room_unlink(player_info* player);
+int room_move(player_info* player, int id);
+int room_changes(roster* r, uint64_t since);
+int room_count(void);
+void room_foreach(void (*fn)(int id, int count, void* arg), void* arg);
+
+#endif  // _ROOM_H
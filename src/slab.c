@@ -0,0 +1,194 @@
+// A slab allocator: per-thread pools of fixed-size objects.
+
+// Connections come and go in bursts (everybody reconnects after a
+// restart), and every one of them needs a player struct with its read
+// buffer and outbound queue. Instead of going to malloc and free for
+// each, objects are carved out of big slabs and recycled: a freed
+// object goes on a free list and is handed straight back out by the
+// next allocation. Slabs are never returned to the system, so after the
+// first burst the pool is simply the right size.
+//
+// Each thread allocates from its own pool, so the common case takes no
+// locks and touches no shared memory. Every object remembers which pool
+// it came from. Freeing an object on the thread that owns it is a push
+// onto that pool's free list; an object freed by any other thread (the
+// RCU callback that frees a player can run anywhere) is pushed onto the
+// owner's "remote" stack with a compare-and-swap instead, and the owner
+// takes the whole stack back in one atomic exchange when its own free
+// list runs out. Since only the owner ever pops, and it takes
+// everything at once, the stack has no ABA problem.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "slab.h"
+
+// The header in front of every object
+
+typedef struct slab_obj {
+    struct slab_local* owner;   // The pool the object came from
+    struct slab_obj* next;      // Next object on a free list
+} slab_obj;
+
+#define SLAB_ALIGN 16
+
+// One thread's pool for one cache. The remote stack and counter are
+// written by other threads, so they get a cache line of their own.
+
+typedef struct slab_local {
+    struct slab_local* next;    // Next pool of the same cache
+    slab_cache* cache;
+    slab_obj* free;             // Objects ready to be handed out
+    char* bump;                 // Unused part of the newest slab
+    char* bump_end;
+    atomic_ulong slabs;
+    atomic_ulong allocs;
+    atomic_ulong local_frees;
+    _Alignas(64) _Atomic(slab_obj*) remote;  // Freed by other threads
+    atomic_ulong remote_frees;
+} slab_local;
+
+static __thread slab_local* locals[SLAB_MAXCACHES];
+static atomic_int ncaches;
+
+/***************************************************************************
+ * slab_cache_init sets up a cache of "size"-byte objects, allocated
+ * "per_slab" at a time. Must be called before any thread allocates.
+ */
+void slab_cache_init(slab_cache* c, const char* name, size_t size, int per_slab) {
+    c->id = atomic_fetch_add(&ncaches, 1);
+    if (c->id >= SLAB_MAXCACHES) {
+        fprintf(stderr, "slab_cache_init: too many caches\n");
+        exit(1);
+    }
+    c->name = name;
+    c->stride = (sizeof(slab_obj) + size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    c->per_slab = per_slab;
+    pthread_mutex_init(&c->lock, NULL);
+    c->pools = NULL;
+}
+
+/***************************************************************************
+ * Create the calling thread's pool for cache "c".
+ */
+static slab_local* new_local(slab_cache* c) {
+    slab_local* l = aligned_alloc(_Alignof(slab_local), sizeof(slab_local));
+    if (l == NULL) {
+        perror("slab - allocating pool");
+        exit(1);
+    }
+    l->cache = c;
+    l->free = NULL;
+    l->bump = NULL;
+    l->bump_end = NULL;
+    atomic_init(&l->slabs, 0);
+    atomic_init(&l->allocs, 0);
+    atomic_init(&l->local_frees, 0);
+    atomic_init(&l->remote, NULL);
+    atomic_init(&l->remote_frees, 0);
+
+    pthread_mutex_lock(&c->lock);
+    l->next = c->pools;
+    c->pools = l;
+    pthread_mutex_unlock(&c->lock);
+
+    locals[c->id] = l;
+    return l;
+}
+
+/***************************************************************************
+ * Carve a fresh object out of the newest slab, allocating a new slab if
+ * that one is used up. Objects are carved one at a time, so the pages of
+ * a new slab aren't touched until they are needed.
+ */
+static slab_obj* carve(slab_local* l) {
+    slab_cache* c = l->cache;
+    if (l->bump == l->bump_end) {
+        l->bump = malloc(c->stride * c->per_slab);
+        if (l->bump == NULL) {
+            perror("slab - allocating slab");
+            exit(1);
+        }
+        l->bump_end = l->bump + c->stride * c->per_slab;
+        atomic_fetch_add_explicit(&l->slabs, 1, memory_order_relaxed);
+    }
+
+    slab_obj* o = (slab_obj*)l->bump;
+    l->bump += c->stride;
+    o->owner = l;
+    o->next = NULL;
+    return o;
+}
+
+/***************************************************************************
+ * slab_alloc returns an object from cache "c" (its contents are
+ * whatever the last user left there).
+ */
+void* slab_alloc(slab_cache* c) {
+    slab_local* l = locals[c->id];
+    if (l == NULL)
+        l = new_local(c);
+
+    slab_obj* o = l->free;
+    if (o == NULL) {
+        // Take back everything other threads have freed
+        o = atomic_exchange_explicit(&l->remote, NULL, memory_order_acquire);
+        if (o == NULL)
+            o = carve(l);
+    }
+    l->free = o->next;
+
+    atomic_fetch_add_explicit(&l->allocs, 1, memory_order_relaxed);
+    return (char*)o + sizeof(slab_obj);
+}
+
+/***************************************************************************
+ * slab_free gives an object back to the pool it came from. Can be
+ * called from any thread.
+ */
+void slab_free(void* p) {
+    if (p == NULL)
+        return;
+
+    slab_obj* o = (slab_obj*)((char*)p - sizeof(slab_obj));
+    slab_local* l = o->owner;
+    if (locals[l->cache->id] == l) {
+        o->next = l->free;
+        l->free = o;
+        atomic_fetch_add_explicit(&l->local_frees, 1, memory_order_relaxed);
+        return;
+    }
+
+    slab_obj* head = atomic_load_explicit(&l->remote, memory_order_relaxed);
+    do {
+        o->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&l->remote, &head, o,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    atomic_fetch_add_explicit(&l->remote_frees, 1, memory_order_relaxed);
+}
+
+/***************************************************************************
+ * slab_get_stats adds up the occupancy of every thread's pool. The
+ * counters are read while they change, so this is only a snapshot.
+ */
+void slab_get_stats(slab_cache* c, slab_stats* stats) {
+    unsigned long frees = 0;
+    stats->slabs = 0;
+    stats->allocs = 0;
+    stats->remote_frees = 0;
+
+    pthread_mutex_lock(&c->lock);
+    for (slab_local* l = c->pools; l != NULL; l = l->next) {
+        stats->slabs += atomic_load(&l->slabs);
+        stats->allocs += atomic_load(&l->allocs);
+        stats->remote_frees += atomic_load(&l->remote_frees);
+        frees += atomic_load(&l->local_frees);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    frees += stats->remote_frees;
+    stats->capacity = stats->slabs * c->per_slab;
+    stats->in_use = (stats->allocs > frees) ? stats->allocs - frees : 0;
+}
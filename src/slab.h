@@ -0,0 +1,48 @@
+// Prototypes for the slab module: per-thread pools of fixed-size objects
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// The most caches that can be set up (each thread has a pool for each)
+
+#define SLAB_MAXCACHES 8
+
+// Default number of objects carved out of each slab
+
+#define SLAB_DEF_PERSLAB 64
+
+struct slab_local;
+
+// A cache hands out objects of one size. Each thread that allocates
+// from it gets its own pool, so allocating never takes a lock; objects
+// freed by another thread are handed back to their owner's pool.
+
+typedef struct {
+    const char* name;
+    int id;                     // Index of this thread's pool
+    size_t stride;              // Object size including the header
+    int per_slab;               // Objects per slab
+    pthread_mutex_t lock;       // Protects the list of pools
+    struct slab_local* pools;   // Every thread's pool for this cache
+} slab_cache;
+
+// Occupancy of a cache, summed over every thread's pool
+
+typedef struct {
+    unsigned long slabs;         // Slabs allocated (never given back)
+    unsigned long capacity;      // Objects those slabs hold
+    unsigned long in_use;        // Objects allocated and not yet freed
+    unsigned long allocs;        // Objects ever allocated
+    unsigned long remote_frees;  // Objects freed by a thread not their owner
+} slab_stats;
+
+void slab_cache_init(slab_cache* c, const char* name, size_t size, int per_slab);
+void* slab_alloc(slab_cache* c);
+void slab_free(void* p);
+void slab_get_stats(slab_cache* c, slab_stats* stats);
+
+#endif  // _SLAB_H
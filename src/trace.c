@@ -0,0 +1,193 @@
+// The trace module records what each thread was doing, and when, so
+// that a latency spike can be pinned on the lock or write that caused it.
+
+// Trace points (see trace.h) around accepts, reads, commands, lock waits,
+// writes and epoll waits record a span each into a ring buffer owned by
+// the calling thread: a timestamp counter read, a few stores, no locks
+// and nothing shared. The rings only hold the last TRACE_RINGSIZE events
+// per thread, so tracing can be left running; trace_dump writes what is
+// in them as a Chrome trace (JSON), which chrome://tracing and
+// ui.perfetto.dev both open, with one track per thread.
+//
+// The trace points only exist in a "make TRACE=1" build. In a normal
+// build this module is still linked, but nothing ever records into it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+// One recorded span
+
+typedef struct {
+    unsigned long start;   // trace_clock() at the start
+    unsigned long dur;     // Length, in trace_clock() ticks
+    int event;             // TRACE_* event
+    long arg;              // Event-specific number
+} trace_event;
+
+// One thread's ring. Only the owning thread writes it.
+
+typedef struct trace_ring {
+    struct trace_ring* next;   // Next thread's ring
+    int id;                    // Thread number, in order of first event
+    atomic_ulong head;         // Events ever recorded
+    trace_event events[TRACE_RINGSIZE];
+} trace_ring;
+
+static __thread trace_ring* self;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring* rings;
+static int nrings;
+
+// The clock when tracing started, in both ticks and nanoseconds, to
+// convert between them at dump time
+
+static unsigned long base_ticks;
+static unsigned long base_ns;
+
+static const char* event_names[TRACE_NEVENTS] = {
+    "accept", "recv", "command", "lock wait", "sendmsg", "epoll_wait"
+};
+
+/************************************************************************
+ * trace_init notes the starting time. Should be called once at the
+ * beginning of main, before any trace points are reached.
+ */
+void trace_init(void) {
+    base_ticks = trace_clock();
+    base_ns = metrics_now();
+}
+
+/************************************************************************
+ * Make the calling thread's ring.
+ */
+static trace_ring* new_ring(void) {
+    trace_ring* r = calloc(1, sizeof(trace_ring));
+    if (r == NULL) {
+        perror("trace - allocating ring");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    r->id = nrings++;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+/************************************************************************
+ * trace_record records an event that started at "start" (a trace_clock()
+ * value) and ends now. Called through TRACE_END.
+ */
+void trace_record(int event, unsigned long start, long arg) {
+    unsigned long end = trace_clock();
+    trace_ring* r = self;
+    if (r == NULL)
+        r = self = new_ring();
+
+    unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_event* e = &r->events[h & (TRACE_RINGSIZE - 1)];
+    e->start = start;
+    e->dur = end - start;
+    e->event = event;
+    e->arg = arg;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+/************************************************************************
+ * Write the argument of event "e" as the JSON "args" object.
+ */
+static void write_args(FILE* fp, trace_event* e) {
+    switch (e->event) {
+    case TRACE_ACCEPT:
+        fprintf(fp, "{\"fd\":%ld}", e->arg);
+        break;
+    case TRACE_COMMAND:
+        fprintf(fp, "{\"verb\":\"%s\"}", metrics_verb_name(e->arg));
+        break;
+    case TRACE_LOCK_WAIT:
+        fprintf(fp, "{\"lock\":\"%s\"}", metrics_lock_name(e->arg));
+        break;
+    case TRACE_EPOLL_WAIT:
+        fprintf(fp, "{\"events\":%ld}", e->arg);
+        break;
+    default:
+        fprintf(fp, "{\"bytes\":%ld}", e->arg);
+    }
+}
+
+/************************************************************************
+ * trace_dump writes every thread's ring to file "path" as a Chrome trace
+ * and returns the number of events written, or -1 if the file couldn't
+ * be written. The other threads carry on recording meanwhile; events
+ * they overwrite while their ring is being copied are left out.
+ */
+int trace_dump(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+
+    trace_event* copy = malloc(TRACE_RINGSIZE * sizeof(trace_event));
+    if (copy == NULL) {
+        perror("trace - dumping");
+        exit(1);
+    }
+
+    // Ticks per microsecond, measured over the whole run so far
+    unsigned long ns = metrics_now() - base_ns;
+    double ticks_per_us = (ns > 0) ? (trace_clock() - base_ticks) * 1e3 / ns
+                                   : 1e3;
+
+    int pid = getpid();
+    int count = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"arena\"}}", pid);
+
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring* r = rings; r != NULL; r = r->next) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", pid, r->id,
+                r->id);
+
+        // Copy the ring, then skip the events whose slots were (or are
+        // being) reused meanwhile: everything before "now" + 1 - RINGSIZE
+        unsigned long head = atomic_load_explicit(&r->head,
+                                                  memory_order_acquire);
+        unsigned long first = (head > TRACE_RINGSIZE) ? head - TRACE_RINGSIZE
+                                                      : 0;
+        for (unsigned long i = first; i < head; i++)
+            copy[i - first] = r->events[i & (TRACE_RINGSIZE - 1)];
+        unsigned long now = atomic_load_explicit(&r->head,
+                                                 memory_order_acquire);
+        unsigned long from = first;
+        if (now + 1 > from + TRACE_RINGSIZE)
+            from = now + 1 - TRACE_RINGSIZE;
+        for (unsigned long i = from; i < head; i++) {
+            trace_event* e = &copy[i - first];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":",
+                    event_names[e->event], pid, r->id,
+                    (double)(long)(e->start - base_ticks) / ticks_per_us,
+                    e->dur / ticks_per_us);
+            write_args(fp, e);
+            fputc('}', fp);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    fprintf(fp, "\n]}\n");
+    free(copy);
+    if (fclose(fp) != 0)
+        return -1;
+    return count;
+}
@@ -0,0 +1,60 @@
+// Prototypes for the trace module: compile-time optional trace points
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <time.h>
+
+// Trace events. Each is a span (a start time and a duration) plus one
+// number, whose meaning depends on the event.
+
+#define TRACE_ACCEPT 0      // Setting up a new connection (fd)
+#define TRACE_RECV 1        // recv() call (bytes read, or -1)
+#define TRACE_COMMAND 2     // Running a command (METRIC_VERB_* id)
+#define TRACE_LOCK_WAIT 3   // Waiting for a busy lock (METRIC_LOCK_* id)
+#define TRACE_SENDMSG 4     // sendmsg() call (bytes written, or -1)
+#define TRACE_EPOLL_WAIT 5  // Reactor waiting for events (events returned)
+#define TRACE_NEVENTS 6
+
+// Events kept per thread. When a thread's ring is full, each new event
+// overwrites its oldest.
+
+#define TRACE_RINGSIZE 65536
+
+// The timestamp counter: the TSC where there is one (a couple of dozen
+// cycles to read), otherwise the monotonic clock in nanoseconds.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline unsigned long trace_clock(void) {
+    return __rdtsc();
+}
+#else
+static inline unsigned long trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+void trace_init(void);
+void trace_record(int event, unsigned long start, long arg);
+int trace_dump(const char* path);
+
+// Trace points. TRACE_START notes the time in a new variable "var", and
+// TRACE_END records the span from then to now. Unless the server is
+// built with "make TRACE=1" (which defines ARENA_TRACE), both compile
+// to nothing.
+
+#ifdef ARENA_TRACE
+#define TRACE_ENABLED 1
+#define TRACE_START(var) unsigned long var = trace_clock()
+#define TRACE_END(var, event, arg) trace_record((event), (var), (arg))
+#else
+#define TRACE_ENABLED 0
+#define TRACE_START(var) do { } while (0)
+#define TRACE_END(var, event, arg) do { } while (0)
+#endif
+
+#endif  // _TRACE_H
@@ -0,0 +1,299 @@
+// The uring module is a minimal wrapper around the io_uring system calls.
+
+// It does only what the io_uring reactor needs (see reactor.c): set up
+// a ring, hand out submission queue entries, submit them and wait for
+// completions, and manage a ring of provided buffers for multishot
+// receives. It talks to the kernel directly rather than through
+// liburing, so the server has no new build dependency -- all that is
+// needed is a kernel new enough (6.0 or so) for multishot receives and
+// buffer rings, which uring_probe checks for at startup.
+//
+// A ring belongs to one thread. The rings shared with the kernel are
+// read and written with acquire and release ordering, as the io_uring
+// ABI requires; everything else is plain.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// Operations the io_uring reactor uses
+
+static const int needed_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+    IORING_OP_ASYNC_CANCEL
+};
+
+/***************************************************************************
+ * Map one of the rings (or the SQE array) of io_uring "fd".
+ */
+static void* map_ring(int fd, size_t size, off_t offset) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+/***************************************************************************
+ * uring_init sets up an io_uring with (at least) "entries" submission
+ * queue entries and a completion queue eight times that size, since
+ * multishot requests post many completions per submission. Returns true
+ * on success, or false (with errno set) if the kernel won't allow it.
+ *
+ * The ring is asked to run completion work only when we wait for it
+ * (DEFER_TASKRUN), which suits a reactor that only ever looks at
+ * completions from its own thread.
+ */
+int uring_init(uring* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 8;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return 0;
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return 0;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = 0;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_map = map_ring(r->fd, r->sq_map_size, IORING_OFF_SQ_RING);
+    r->cq_map = (r->cq_map_size == 0) ? r->sq_map :
+                map_ring(r->fd, r->cq_map_size, IORING_OFF_CQ_RING);
+    r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+    if ((r->sq_map == NULL) || (r->cq_map == NULL) || (r->sqes == NULL)) {
+        uring_destroy(r);
+        return 0;
+    }
+
+    char* sq = r->sq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+
+    // SQE i always goes in slot i, so the index array is set up once
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    char* cq = r->cq_map;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+/***************************************************************************
+ * uring_destroy unmaps and closes a ring (which also cancels anything
+ * still in flight).
+ */
+void uring_destroy(uring* r) {
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if ((r->cq_map != NULL) && (r->cq_map != r->sq_map))
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map != NULL)
+        munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/***************************************************************************
+ * uring_probe checks that this kernel (and whatever sandbox we run in)
+ * supports everything the io_uring reactor uses, by setting up a small
+ * ring, asking which operations it supports, and registering a buffer
+ * ring with it. Returns true if so.
+ */
+int uring_probe(void) {
+    uring r;
+    if (!uring_init(&r, 8))
+        return 0;
+
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL) {
+        perror("uring_probe");
+        exit(1);
+    }
+    int ok = (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE,
+                      probe, 256) == 0);
+    for (int i = 0; ok && (i < sizeof(needed_ops) / sizeof(needed_ops[0])); i++) {
+        int op = needed_ops[i];
+        ok = (op <= probe->last_op) &&
+             (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    // Multishot receives came with buffer rings, so this covers both
+    uring_bufs b;
+    ok = ok && uring_bufs_init(&r, &b, 0, 1, 64);
+    if (ok) {
+        munmap(b.ring, sizeof(struct io_uring_buf));
+        free(b.data);
+    }
+    uring_destroy(&r);
+    return ok;
+}
+
+/***************************************************************************
+ * uring_reserve makes sure there are at least "n" free submission queue
+ * entries, submitting what is queued if need be. A chain of linked
+ * requests must be reserved first, so that it isn't split across two
+ * submissions (which would break the link).
+ */
+void uring_reserve(uring* r, unsigned n) {
+    while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n >
+           r->sq_entries) {
+        if ((uring_enter(r, 0, -1) < 0) && (errno != EINTR) &&
+            (errno != EBUSY)) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+}
+
+/***************************************************************************
+ * uring_sqe returns the next free submission queue entry, zeroed, to be
+ * filled in by the caller and submitted by the next uring_enter. If the
+ * queue is full, what is in it is submitted first to make room.
+ */
+struct io_uring_sqe* uring_sqe(uring* r) {
+    uring_reserve(r, 1);
+
+    struct io_uring_sqe* sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqe_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+/***************************************************************************
+ * uring_enter submits every SQE filled in since the last call and, if
+ * "wait_nr" is non-zero, waits until that many completions are ready or
+ * "timeout_ns" nanoseconds have passed (-1 for no limit). Completions
+ * are then read with uring_peek. Returns the number of SQEs submitted,
+ * or -1 with errno set (ETIME if the wait timed out).
+ */
+int uring_enter(uring* r, unsigned wait_nr, long timeout_ns) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    // With DEFER_TASKRUN, completions are only posted when we ask for
+    // events, so always do
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void* argp = NULL;
+    size_t argsz = 0;
+    if ((wait_nr > 0) && (timeout_ns >= 0)) {
+        ts.tv_sec = timeout_ns / 1000000000L;
+        ts.tv_nsec = timeout_ns % 1000000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                      flags, argp, argsz);
+    if (ret > 0)
+        r->to_submit -= ret;
+    return ret;
+}
+
+/***************************************************************************
+ * uring_peek returns the oldest completion not yet seen, or NULL if
+ * there are none. uring_seen hands it back to the kernel, so copy out
+ * anything needed from it first.
+ */
+struct io_uring_cqe* uring_peek(uring* r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_seen(uring* r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/***************************************************************************
+ * uring_bufs_init registers a ring of "nbufs" (a power of two) provided
+ * buffers of "size" bytes with io_uring "r", as buffer group "bgid", and
+ * hands them all to the kernel. Returns true on success, or false (with
+ * nothing allocated) if the kernel doesn't support buffer rings.
+ */
+int uring_bufs_init(uring* r, uring_bufs* b, int bgid, unsigned nbufs,
+                    size_t size) {
+    size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED) {
+        perror("uring_bufs_init");
+        exit(1);
+    }
+    if ((b->data = malloc(nbufs * size)) == NULL) {
+        perror("uring_bufs_init");
+        exit(1);
+    }
+    b->nbufs = nbufs;
+    b->size = size;
+    b->tail = 0;
+    b->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        munmap(b->ring, ring_size);
+        free(b->data);
+        return 0;
+    }
+
+    for (unsigned i = 0; i < nbufs; i++)
+        uring_buf_recycle(b, i);
+    return 1;
+}
+
+/***************************************************************************
+ * uring_buf is the data of buffer "bid" (as given in a completion's
+ * flags), and uring_buf_recycle gives it back to the kernel for reuse.
+ */
+char* uring_buf(uring_bufs* b, int bid) {
+    return b->data + bid * b->size;
+}
+
+void uring_buf_recycle(uring_bufs* b, int bid) {
+    struct io_uring_buf* buf = &b->ring->bufs[b->tail & (b->nbufs - 1)];
+    buf->addr = (unsigned long)uring_buf(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    b->tail++;
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
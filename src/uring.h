@@ -0,0 +1,58 @@
+// Prototypes for the uring module: a minimal io_uring wrapper
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// One io_uring instance: the submission and completion rings, as
+// mapped from the kernel. Only the thread that set it up may use it.
+
+typedef struct {
+    int fd;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_head;             // Kernel's position (it consumes)
+    unsigned* sq_tail;             // Ours (published on uring_enter)
+    unsigned sqe_tail;             // Next free SQE, not yet published
+    unsigned to_submit;            // SQEs filled since the last enter
+    struct io_uring_sqe* sqes;
+    unsigned cq_mask;
+    unsigned* cq_head;             // Ours (we consume)
+    unsigned* cq_tail;             // Kernel's position
+    struct io_uring_cqe* cqes;
+    void* sq_map;                  // Mappings, for uring_destroy
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring;
+
+// A ring of provided buffers: the kernel picks one of them for each
+// completion of a buffer-select read (multishot recv), and we hand it
+// back once its data has been used.
+
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    char* data;                    // "nbufs" buffers of "size" bytes
+    unsigned nbufs;
+    size_t size;
+    unsigned short tail;
+    int bgid;                      // Buffer group id, for the SQEs
+} uring_bufs;
+
+int uring_probe(void);
+int uring_init(uring* r, unsigned entries);
+void uring_destroy(uring* r);
+void uring_reserve(uring* r, unsigned n);
+struct io_uring_sqe* uring_sqe(uring* r);
+int uring_enter(uring* r, unsigned wait_nr, long timeout_ns);
+struct io_uring_cqe* uring_peek(uring* r);
+void uring_seen(uring* r);
+int uring_bufs_init(uring* r, uring_bufs* b, int bgid, unsigned nbufs,
+                    size_t size);
+char* uring_buf(uring_bufs* b, int bid);
+void uring_buf_recycle(uring_bufs* b, int bid);
+
+#endif  // _URING_H
@@ -3,6 +3,22 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <string.h>
+
+// A span is a piece of a string that is not NUL-terminated: a pointer
+// and a length. An absent value is a span of length 0.
+
+typedef struct {
+    const char* p;
+    int len;
+} span;
+
 char* trim(char* line);
 
+// True if span "s" holds exactly the string "lit"
+
+static inline int span_eq(span s, const char* lit) {
+    return (strncmp(s.p, lit, s.len) == 0) && (lit[s.len] == '\0');
+}
+
 #endif  // _UTIL_H